@@ -0,0 +1,548 @@
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <stdint.h>
+#include <time.h>
+
+#include <zlib.h>
+
+#include "compat.h"
+#include "util.h"
+#include "archive.h"
+#include "resp.h"
+#include "timing.h"
+
+#define CHUNK 32768
+#define TAR_BLOCK 512
+#define TAR_SIZE_MAX 077777777777ULL
+#define TAR_NAME_MAX 100
+/* Zip fields from these on are stored in zip64 extra fields instead */
+#define ZIP_MAX16 0xffffU
+#define ZIP_MAX32 0xffffffffULL
+
+static const unsigned char zero[2 * TAR_BLOCK];
+
+/* Zip members are remembered for the central directory at the end */
+struct zipent {
+	char *name;
+	unsigned int mode;
+	int zip64;
+	uint32_t crc;
+	uint64_t csize;
+	uint64_t usize;
+	uint64_t off;
+};
+
+struct archive {
+	git_repository *repo;
+	const char *prefix;
+	int fmt;
+	FILE *copy;
+	git_time_t mtime;
+	unsigned int dostime;
+	unsigned int dosdate;
+	z_stream z;
+	uint64_t off;
+	struct zipent *ents;
+	size_t n;
+	size_t cap;
+	jmp_buf *errjmp;
+	int failed;
+	int gone;
+	unsigned char buf[CHUNK];
+};
+
+static unsigned char *
+le16(unsigned char *p, unsigned int v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	return p + 2;
+}
+
+static unsigned char *
+le32(unsigned char *p, uint32_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = (v >> 24) & 0xff;
+	return p + 4;
+}
+
+static unsigned char *
+le64(unsigned char *p, uint64_t v)
+{
+	p = le32(p, v & 0xffffffff);
+	return le32(p, v >> 32);
+}
+
+/* Once the client is gone only the page cache copy is still written */
+static void
+put(struct archive *a, const void *buf, size_t n)
+{
+	if (!a->gone)
+		bput(buf, n);
+	if (a->copy != NULL)
+		fwrite(buf, 1, n, a->copy);
+	a->off += n;
+}
+
+/* Feeds n bytes to the deflate stream, writing out what it produces */
+static void
+pump(struct archive *a, const void *buf, size_t n, int flush)
+{
+	const unsigned char *p = buf;
+	size_t k;
+
+	do {
+		k = n > CHUNK ? CHUNK : n;
+		a->z.next_in = (unsigned char *)p;
+		a->z.avail_in = k;
+		p += k;
+		n -= k;
+		do {
+			a->z.next_out = a->buf;
+			a->z.avail_out = sizeof(a->buf);
+			if (deflate(&a->z, n > 0 ? Z_NO_FLUSH : flush) ==
+			    Z_STREAM_ERROR)
+				eprintf("deflate: stream error\n");
+			put(a, a->buf, sizeof(a->buf) - a->z.avail_out);
+		} while (a->z.avail_out == 0);
+	} while (n > 0);
+}
+
+static void
+tar_pad(struct archive *a, uint64_t size)
+{
+	if (size % TAR_BLOCK)
+		pump(a, zero, TAR_BLOCK - size % TAR_BLOCK, Z_NO_FLUSH);
+}
+
+static void
+tar_block(struct archive *a, const char *name, int type, unsigned int mode,
+    uint64_t size, const char *link)
+{
+	unsigned char h[TAR_BLOCK];
+	unsigned int i, sum;
+
+	memset(h, 0, sizeof(h));
+	strncpy((char *)h, name, TAR_NAME_MAX);
+	snprintf((char *)h + 100, 8, "%07o", mode);
+	snprintf((char *)h + 108, 8, "%07o", 0);
+	snprintf((char *)h + 116, 8, "%07o", 0);
+	snprintf((char *)h + 124, 12, "%011llo",
+	    (unsigned long long)(size > TAR_SIZE_MAX ? 0 : size));
+	snprintf((char *)h + 136, 12, "%011llo",
+	    (unsigned long long)a->mtime & TAR_SIZE_MAX);
+	memset(h + 148, ' ', 8);
+	h[156] = type;
+	if (link != NULL)
+		strncpy((char *)h + 157, link, TAR_NAME_MAX);
+	memcpy(h + 257, "ustar", 6);
+	memcpy(h + 263, "00", 2);
+
+	for (i = 0, sum = 0; i < sizeof(h); i++)
+		sum += h[i];
+	snprintf((char *)h + 148, 8, "%06o", sum);
+	h[155] = ' ';
+
+	pump(a, h, sizeof(h), Z_NO_FLUSH);
+}
+
+/* Appends a pax "len key=value\n" record, len counting itself */
+static size_t
+pax_record(char **buf, size_t len, const char *key, const char *val)
+{
+	size_t n, total;
+	char *p;
+
+	/* A space, an equals sign and a newline besides the key and value */
+	n = strlen(key) + strlen(val) + 3;
+	for (total = n + 1; (size_t)snprintf(NULL, 0, "%zu", total) !=
+	    total - n; total++)
+		;
+
+	if (!(p = realloc(*buf, len + total + 1)))
+		eprintf("realloc:");
+	snprintf(p + len, total + 1, "%zu %s=%s\n", total, key, val);
+	*buf = p;
+
+	return len + total;
+}
+
+/* Writes a tar header, preceded by a pax header for what ustar lacks */
+static void
+tar_entry(struct archive *a, const char *path, int type, unsigned int mode,
+    uint64_t size, const char *link)
+{
+	char *pax = NULL, num[32];
+	size_t len = 0;
+
+	if (strlen(path) > TAR_NAME_MAX)
+		len = pax_record(&pax, len, "path", path);
+	if (link != NULL && strlen(link) > TAR_NAME_MAX)
+		len = pax_record(&pax, len, "linkpath", link);
+	if (size > TAR_SIZE_MAX) {
+		snprintf(num, sizeof(num), "%llu", (unsigned long long)size);
+		len = pax_record(&pax, len, "size", num);
+	}
+
+	if (len > 0) {
+		HOLD(pax, free);
+		tar_block(a, "pax_header", 'x', 0644, len, NULL);
+		pump(a, pax, len, Z_NO_FLUSH);
+		tar_pad(a, len);
+		release(pax);
+	}
+
+	tar_block(a, path, type, mode, size, link);
+}
+
+/*
+ * Writes the local header of e. Sizes follow the data, eight bytes each
+ * when a zip64 extra field here says so.
+ */
+static void
+zip_header(struct archive *a, const struct zipent *e)
+{
+	unsigned char h[30], x[20], *p;
+
+	p = le32(h, 0x04034b50);
+	p = le16(p, e->zip64 ? 45 : 20);
+	/* Sizes follow the data, names are UTF-8 */
+	p = le16(p, 0x0808);
+	p = le16(p, 8);
+	p = le16(p, a->dostime);
+	p = le16(p, a->dosdate);
+	p = le32(p, 0);
+	p = le32(p, e->zip64 ? ZIP_MAX32 : 0);
+	p = le32(p, e->zip64 ? ZIP_MAX32 : 0);
+	p = le16(p, strlen(e->name));
+	le16(p, e->zip64 ? sizeof(x) : 0);
+
+	put(a, h, sizeof(h));
+	put(a, e->name, strlen(e->name));
+
+	if (e->zip64) {
+		p = le16(x, 0x0001);
+		p = le16(p, sizeof(x) - 4);
+		p = le64(p, 0);
+		le64(p, 0);
+		put(a, x, sizeof(x));
+	}
+}
+
+static void
+zip_entry(struct archive *a, const char *path, unsigned int mode,
+    const void *data, size_t size)
+{
+	struct zipent *e;
+	unsigned char d[24], *p;
+	const unsigned char *s;
+	uint64_t start;
+	size_t n, k;
+
+	if (a->n == a->cap) {
+		a->cap = a->cap ? a->cap * 2 : 64;
+		if (!(a->ents = reallocarray(a->ents, a->cap,
+		    sizeof(*a->ents))))
+			eprintf("reallocarray:");
+	}
+	e = &a->ents[a->n];
+	if (!(e->name = strdup(path)))
+		eprintf("strdup:");
+	a->n++;
+	e->mode = mode;
+	e->off = a->off;
+	e->usize = size;
+	if (deflateReset(&a->z) != Z_OK)
+		eprintf("deflateReset: stream error\n");
+	e->zip64 = size >= ZIP_MAX32 || deflateBound(&a->z, size) >= ZIP_MAX32;
+
+	e->crc = crc32(0L, Z_NULL, 0);
+	for (s = data, n = size; n > 0; s += k, n -= k) {
+		k = n > CHUNK ? CHUNK : n;
+		e->crc = crc32(e->crc, s, k);
+	}
+
+	zip_header(a, e);
+	start = a->off;
+	pump(a, data, size, Z_FINISH);
+	e->csize = a->off - start;
+
+	p = le32(d, 0x08074b50);
+	p = le32(p, e->crc);
+	if (e->zip64) {
+		p = le64(p, e->csize);
+		p = le64(p, e->usize);
+	} else {
+		p = le32(p, e->csize);
+		p = le32(p, e->usize);
+	}
+	put(a, d, p - d);
+}
+
+/*
+ * Writes the central directory and its end. Sizes and offsets too large
+ * for their field are set to all ones and given in a zip64 extra field,
+ * and so are the counts and offsets of the end record in a zip64 end
+ * record found through the locator after it.
+ */
+static void
+zip_finish(struct archive *a)
+{
+	unsigned char h[56], x[28], *p, *q;
+	struct zipent *e;
+	uint64_t start, size;
+	int big, bigu, bigc, bigo;
+	size_t i;
+
+	start = a->off;
+	for (i = 0; i < a->n; i++) {
+		e = &a->ents[i];
+		bigu = e->zip64 || e->usize >= ZIP_MAX32;
+		bigc = e->zip64 || e->csize >= ZIP_MAX32;
+		bigo = e->off >= ZIP_MAX32;
+
+		q = x + 4;
+		if (bigu)
+			q = le64(q, e->usize);
+		if (bigc)
+			q = le64(q, e->csize);
+		if (bigo)
+			q = le64(q, e->off);
+		big = q > x + 4;
+		le16(x, 0x0001);
+		le16(x + 2, q - x - 4);
+
+		p = le32(h, 0x02014b50);
+		/* Made by unix so the mode in the external attributes holds */
+		p = le16(p, 3 << 8 | (big ? 45 : 20));
+		p = le16(p, big ? 45 : 20);
+		p = le16(p, 0x0808);
+		p = le16(p, 8);
+		p = le16(p, a->dostime);
+		p = le16(p, a->dosdate);
+		p = le32(p, e->crc);
+		p = le32(p, bigc ? ZIP_MAX32 : e->csize);
+		p = le32(p, bigu ? ZIP_MAX32 : e->usize);
+		p = le16(p, strlen(e->name));
+		p = le16(p, big ? q - x : 0);
+		p = le16(p, 0);
+		p = le16(p, 0);
+		p = le16(p, 0);
+		p = le32(p, (uint32_t)e->mode << 16 |
+		    ((e->mode & 0170000) == 0040000 ? 0x10 : 0));
+		le32(p, bigo ? ZIP_MAX32 : e->off);
+		put(a, h, 46);
+		put(a, e->name, strlen(e->name));
+		if (big)
+			put(a, x, q - x);
+	}
+
+	size = a->off - start;
+	big = a->n >= ZIP_MAX16 || size >= ZIP_MAX32 || start >= ZIP_MAX32;
+	if (big) {
+		q = le32(h, 0x06064b50);
+		q = le64(q, sizeof(h) - 12);
+		q = le16(q, 3 << 8 | 45);
+		q = le16(q, 45);
+		q = le32(q, 0);
+		q = le32(q, 0);
+		q = le64(q, a->n);
+		q = le64(q, a->n);
+		q = le64(q, size);
+		le64(q, start);
+		p = le32(x, 0x07064b50);
+		p = le32(p, 0);
+		p = le64(p, a->off);
+		le32(p, 1);
+		put(a, h, sizeof(h));
+		put(a, x, 20);
+	}
+
+	p = le32(h, 0x06054b50);
+	p = le16(p, 0);
+	p = le16(p, 0);
+	p = le16(p, a->n >= ZIP_MAX16 ? ZIP_MAX16 : a->n);
+	p = le16(p, a->n >= ZIP_MAX16 ? ZIP_MAX16 : a->n);
+	p = le32(p, size >= ZIP_MAX32 ? ZIP_MAX32 : size);
+	p = le32(p, start >= ZIP_MAX32 ? ZIP_MAX32 : start);
+	le16(p, 0);
+	put(a, h, 22);
+}
+
+static void
+add_dir(struct archive *a, const char *path)
+{
+	if (a->fmt == ARCHIVE_TGZ)
+		tar_entry(a, path, '5', 0755, 0, NULL);
+	else
+		zip_entry(a, path, 0040755, NULL, 0);
+}
+
+static void
+add_file(struct archive *a, const char *path, git_filemode_t mode,
+    const git_blob *b)
+{
+	const char *s = git_blob_rawcontent(b);
+	size_t size = git_blob_rawsize(b);
+	char *link;
+
+	if (a->fmt == ARCHIVE_ZIP) {
+		zip_entry(a, path, mode == GIT_FILEMODE_LINK ? 0120777 :
+		    mode == GIT_FILEMODE_BLOB_EXECUTABLE ? 0100755 : 0100644,
+		    s, size);
+		return;
+	}
+
+	if (mode == GIT_FILEMODE_LINK) {
+		if (!(link = malloc(size + 1)))
+			eprintf("malloc:");
+		HOLD(link, free);
+		memcpy(link, s, size);
+		link[size] = '\0';
+		tar_entry(a, path, '2', 0777, 0, link);
+		release(link);
+		return;
+	}
+
+	tar_entry(a, path, '0', mode == GIT_FILEMODE_BLOB_EXECUTABLE ?
+	    0755 : 0644, size, NULL);
+	pump(a, s, size, Z_NO_FLUSH);
+	tar_pad(a, size);
+}
+
+static void
+add_entry(struct archive *a, const char *root, const git_tree_entry *te)
+{
+	git_filemode_t mode;
+	git_blob *b;
+	char *path;
+	size_t n;
+
+	mode = git_tree_entry_filemode(te);
+	n = strlen(a->prefix) + strlen(root) + strlen(git_tree_entry_name(te)) +
+	    2;
+	if (!(path = malloc(n)))
+		eprintf("malloc:");
+	HOLD(path, free);
+	snprintf(path, n, "%s%s%s%s", a->prefix, root, git_tree_entry_name(te),
+	    mode == GIT_FILEMODE_TREE ? "/" : "");
+
+	switch (mode) {
+	case GIT_FILEMODE_TREE:
+		add_dir(a, path);
+		break;
+	case GIT_FILEMODE_BLOB:
+	case GIT_FILEMODE_BLOB_EXECUTABLE:
+	case GIT_FILEMODE_LINK:
+		/* One blob is held at a time, whatever the size of the tree */
+		timing_start(TIMER_INFLATE);
+		if (git_blob_lookup(&b, a->repo, git_tree_entry_id(te)))
+			geprintf("blob lookup %s:", path);
+		timing_stop(TIMER_INFLATE);
+		HOLD(b, git_blob_free);
+		timing_count(COUNT_OBJECTS, 1);
+		timing_count(COUNT_INFLATED, git_blob_rawsize(b));
+		add_file(a, path, mode, b);
+		release(b);
+		break;
+	default:
+		/* Submodules have no content of their own */
+		break;
+	}
+
+	release(path);
+}
+
+/*
+ * Errors end the walk through its return value rather than unwinding
+ * through libgit2, and are raised again once it returned. What was held
+ * meanwhile is left for that. The walk also stops when the client went
+ * away, unless the archive is being written to the page cache.
+ */
+static int
+walk_entry(const char *root, const git_tree_entry *te, void *arg)
+{
+	struct archive *a = arg;
+	jmp_buf jb;
+
+	if (setjmp(jb)) {
+		catch_errors(a->errjmp);
+		a->failed = 1;
+		return -1;
+	}
+	a->errjmp = catch_errors(&jb);
+	add_entry(a, root, te);
+	catch_errors(a->errjmp);
+
+	if (resp_failed()) {
+		a->gone = 1;
+		if (a->copy == NULL)
+			return -1;
+	}
+	return 0;
+}
+
+static void
+archive_free(struct archive *a)
+{
+	size_t i;
+
+	deflateEnd(&a->z);
+	for (i = 0; i < a->n; i++)
+		free(a->ents[i].name);
+	free(a->ents);
+	free(a);
+}
+
+void
+archive_write(git_repository *repo, const git_tree *t, const char *prefix,
+    git_time_t mtime, int fmt, FILE *copy)
+{
+	struct archive *a;
+	time_t tt = mtime;
+	struct tm tm;
+
+	if (!(a = calloc(1, sizeof(*a))))
+		eprintf("calloc:");
+	HOLD(a, archive_free);
+	a->repo = repo;
+	a->prefix = prefix;
+	a->fmt = fmt;
+	a->copy = copy;
+	a->mtime = mtime < 0 ? 0 : mtime;
+
+	if (gmtime_r(&tt, &tm) != NULL && tm.tm_year >= 80) {
+		a->dostime = tm.tm_hour << 11 | tm.tm_min << 5 | tm.tm_sec / 2;
+		a->dosdate = (tm.tm_year - 80) << 9 | (tm.tm_mon + 1) << 5 |
+		    tm.tm_mday;
+	} else
+		a->dosdate = 1 << 5 | 1;
+
+	/* A gzip wrapper around the whole tar, raw deflate per zip member */
+	if (deflateInit2(&a->z, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+	    fmt == ARCHIVE_TGZ ? 15 + 16 : -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		eprintf("deflateInit2: failed\n");
+
+	add_dir(a, prefix);
+	if (git_tree_walk(t, GIT_TREEWALK_PRE, walk_entry, a)) {
+		if (a->gone) {
+			release(a);
+			return;
+		}
+		if (a->failed)
+			eprintf("archive: cut short\n");
+		geprintf("tree walk:");
+	}
+
+	if (fmt == ARCHIVE_TGZ) {
+		/* Two zero blocks end a tar */
+		pump(a, zero, sizeof(zero), Z_FINISH);
+	} else
+		zip_finish(a);
+
+	release(a);
+}
@@ -0,0 +1,5 @@
+#define ARCHIVE_TGZ 0
+#define ARCHIVE_ZIP 1
+
+void archive_write(git_repository *, const git_tree *, const char *,
+    git_time_t, int, FILE *);
@@ -0,0 +1,127 @@
+#include <stdint.h>
+
+#include "util.h"
+#include "arena.h"
+
+/* Size of the blocks allocations are carved from */
+#define ARENA_BLOCK 65536
+/* Allocations larger than this get a block of their own */
+#define ARENA_LARGE (ARENA_BLOCK / 4)
+
+/* Alignment suiting anything allocated */
+union align {
+	long double d;
+	intmax_t i;
+	void *p;
+	void (*fn)(void);
+};
+
+#define ALIGN(n) (((n) + sizeof(union align) - 1) & \
+    ~(sizeof(union align) - 1))
+
+struct block {
+	struct block *next;
+	size_t size;
+	size_t used;
+};
+
+/*
+ * Scratch memory of the request being served, freed all at once when it
+ * is done rather than piece by piece. Allocations are bumped off the
+ * block at the head of the list. The first block is kept from one
+ * request to the next, the others are given back. Each thread serving
+ * requests has its own.
+ */
+static __thread struct block *blocks;
+static __thread struct block *first;
+
+static struct block *
+block_new(size_t size)
+{
+	struct block *b;
+
+	if (!(b = malloc(ALIGN(sizeof(*b)) + size)))
+		eprintf("malloc:");
+	b->size = size;
+	b->used = 0;
+	return b;
+}
+
+/*
+ * Allocates n bytes lasting until the end of the request. Errors unwind
+ * like any other, there is nothing to free on the way.
+ */
+void *
+arena_alloc(size_t n)
+{
+	struct block *b;
+
+	n = ALIGN(n ? n : 1);
+	if (blocks != NULL && blocks->size - blocks->used >= n) {
+		b = blocks;
+	} else if (n > ARENA_LARGE) {
+		/* Behind the head, which still has room for small ones */
+		b = block_new(n);
+		if (blocks == NULL) {
+			b->next = NULL;
+			blocks = b;
+		} else {
+			b->next = blocks->next;
+			blocks->next = b;
+		}
+	} else {
+		b = block_new(ARENA_BLOCK);
+		b->next = blocks;
+		blocks = b;
+		if (first == NULL)
+			first = b;
+	}
+
+	b->used += n;
+	return (char *)b + ALIGN(sizeof(*b)) + b->used - n;
+}
+
+void *
+arena_array(size_t nmemb, size_t size)
+{
+	if (size != 0 && nmemb > SIZE_MAX / size) {
+		errno = ENOMEM;
+		eprintf("arena_array:");
+	}
+	return arena_alloc(nmemb * size);
+}
+
+char *
+arena_strndup(const char *s, size_t n)
+{
+	char *p;
+
+	n = strnlen(s, n);
+	p = arena_alloc(n + 1);
+	memcpy(p, s, n);
+	p[n] = '\0';
+	return p;
+}
+
+char *
+arena_strdup(const char *s)
+{
+	return arena_strndup(s, SIZE_MAX);
+}
+
+/* Frees everything allocated for the request in one go */
+void
+arena_reset(void)
+{
+	struct block *b, *next;
+
+	for (b = blocks; b != NULL; b = next) {
+		next = b->next;
+		if (b != first)
+			free(b);
+	}
+	if ((blocks = first) != NULL) {
+		first->next = NULL;
+		first->used = 0;
+	}
+}
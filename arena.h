@@ -0,0 +1,5 @@
+void *arena_alloc(size_t);
+void *arena_array(size_t, size_t);
+char *arena_strdup(const char *);
+char *arena_strndup(const char *, size_t);
+void arena_reset(void);
@@ -0,0 +1,173 @@
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <stdint.h>
+#include <time.h>
+
+#include "../util.h"
+#include "../resp.h"
+
+/* Bytes of each input and the rounds the best time is taken of */
+#define BENCH_BYTES (16 << 20)
+#define BENCH_ROUNDS 5
+
+/*
+ * The escaping functions as they were before scanning for the next byte
+ * to escape many at a time, writing to the body like the current ones.
+ */
+static const unsigned char htmlspecial[256] = {
+	['\0'] = 1, ['&'] = 1, ['<'] = 1, ['>'] = 1, ['"'] = 1, ['\''] = 1
+};
+
+static void
+old_htmlescn(const char *s, size_t n)
+{
+	const char *p, *end;
+
+	for (p = s, end = s + n; p < end; p++) {
+		if (!htmlspecial[(unsigned char)*p])
+			continue;
+		if (p > s)
+			bput(s, p - s);
+		if (*p == '\0')
+			bputs("&#65533;");
+		else
+			htmlescchar(*p);
+		s = p + 1;
+	}
+	if (p > s)
+		bput(s, p - s);
+}
+
+static void
+old_urienc(const char *s)
+{
+	for (; s && *s; s++)
+		if ((unsigned char)*s <= 0x1F || (unsigned char)*s >= 0x7F ||
+		    strchr(" <>\"%{}|\\^`", *s))
+			bprintf("%%%02X", (unsigned char)*s);
+		else
+			bputc(*s);
+}
+
+static void
+old_queryenc(const char *s)
+{
+	for (; s && *s; s++)
+		if ((unsigned char)*s <= 0x1F || (unsigned char)*s >= 0x7F ||
+		    strchr(" <>\"%{}|\\^`#&'+;=?", *s))
+			bprintf("%%%02X", (unsigned char)*s);
+		else
+			bputc(*s);
+}
+
+/* Both html escapers over the whole string, as the others are */
+static void
+old_htmlesc(const char *s)
+{
+	old_htmlescn(s, strlen(s));
+}
+
+static void
+new_htmlesc(const char *s)
+{
+	htmlescn(s, strlen(s));
+}
+
+/* Fills buf with text having a byte to escape every so many */
+static void
+fill(char *buf, size_t n, size_t every, const char *special)
+{
+	static const char text[] = "the quick brown fox jumps over the "
+	    "lazy dog/src/lib/";
+	size_t i, k = 0;
+
+	for (i = 0; i < n; i++)
+		buf[i] = text[i % (sizeof(text) - 1)];
+	for (i = every; every > 0 && i < n; i += every)
+		buf[i] = special[k++ % strlen(special)];
+	buf[n] = '\0';
+}
+
+static double
+elapsed(const struct timespec *t0)
+{
+	struct timespec t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+/* Best time of fn over the input, leaving its output in the body */
+static double
+run(void (*fn)(const char *), const char *in)
+{
+	struct timespec t0;
+	double t, best = 0;
+	int i;
+
+	for (i = 0; i < BENCH_ROUNDS; i++) {
+		resp_begin(NULL, NULL);
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		fn(in);
+		t = elapsed(&t0);
+		if (i == 0 || t < best)
+			best = t;
+	}
+	return best;
+}
+
+static int
+compare(const char *name, void (*oldfn)(const char *),
+    void (*newfn)(const char *), const char *in)
+{
+	const struct buf *b;
+	double told, tnew;
+	char *out;
+	size_t len;
+	int same;
+
+	told = run(oldfn, in);
+	b = resp_body();
+	len = b->len;
+	if (!(out = malloc(len + 1)))
+		eprintf("malloc:");
+	memcpy(out, b->s, len);
+
+	tnew = run(newfn, in);
+	b = resp_body();
+	same = b->len == len && !memcmp(b->s, out, len);
+	free(out);
+
+	printf("%-24s old %8.1f MB/s  new %8.1f MB/s  %5.2fx%s\n", name,
+	    strlen(in) / told / 1e6, strlen(in) / tnew / 1e6, told / tnew,
+	    same ? "" : "  OUTPUT DIFFERS");
+	return same ? 0 : 1;
+}
+
+int
+main(void)
+{
+	char *in;
+	int bad = 0;
+
+	if (!(in = malloc(BENCH_BYTES + 1)))
+		eprintf("malloc:");
+
+	fill(in, BENCH_BYTES, 0, "");
+	bad |= compare("html, clean", old_htmlesc, new_htmlesc, in);
+	fill(in, BENCH_BYTES, 97, "<&>\"'");
+	bad |= compare("html, 1 in 97", old_htmlesc, new_htmlesc, in);
+	fill(in, BENCH_BYTES, 8, "<&");
+	bad |= compare("html, 1 in 8", old_htmlesc, new_htmlesc, in);
+
+	fill(in, BENCH_BYTES, 0, "");
+	bad |= compare("uri, clean", old_urienc, urienc, in);
+	fill(in, BENCH_BYTES, 97, " %\x7f\xc3");
+	bad |= compare("uri, 1 in 97", old_urienc, urienc, in);
+	fill(in, BENCH_BYTES, 97, "&=?+ ");
+	bad |= compare("query, 1 in 97", old_queryenc, queryenc, in);
+
+	free(in);
+	return bad;
+}
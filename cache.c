@@ -0,0 +1,295 @@
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "compat.h"
+#include "util.h"
+#include "resp.h"
+#include "cache.h"
+
+#define PAGES_DIR CACHE_DIR"/pages"
+#define NSHARDS 16
+/* Pages larger than this go out while they are read */
+#define CACHE_STREAM (1 << 20)
+/* Longest key a page is kept under, longer ones are not cached */
+#define CACHE_KEY_MAX 4096
+
+struct entry {
+	char name[32];
+	off_t size;
+	time_t mtime;
+};
+
+static uint64_t
+keyhash(const char *key)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	for (; *key; key++)
+		h = (h ^ (unsigned char)*key) * 1099511628211ULL;
+	return h;
+}
+
+/* Pages are spread over NSHARDS directories named by the top hash bits */
+static void
+page_path(char *dir, size_t dn, char *path, size_t pn, const char *key)
+{
+	uint64_t h;
+
+	h = keyhash(key);
+	snprintf(dir, dn, "%s/%x", PAGES_DIR, (unsigned int)(h >> 60));
+	snprintf(path, pn, "%s/%016" PRIx64, dir, h);
+}
+
+/*
+ * Tells whether the key stored in front of a page is key, which rules
+ * out hash collisions. It is compared a buffer at a time.
+ */
+static int
+key_matches(FILE *cf, const char *key)
+{
+	char buf[BUFSIZ];
+	size_t n, klen;
+
+	for (klen = strlen(key); klen > 0; klen -= n, key += n) {
+		n = klen < sizeof(buf) ? klen : sizeof(buf);
+		if (fread(buf, 1, n, cf) != n || memcmp(buf, key, n))
+			return 0;
+	}
+	return getc(cf) == '\n';
+}
+
+/*
+ * Loads the page of key into the response. Pages hold the header fields
+ * of the response, a blank line and the body; large bodies are streamed.
+ */
+int
+cache_get(const char *key)
+{
+	char dir[PATH_MAX], path[PATH_MAX], buf[BUFSIZ];
+	struct stat st;
+	size_t n;
+	off_t len;
+	FILE *cf;
+
+	if (strlen(key) > CACHE_KEY_MAX)
+		return 0;
+	page_path(dir, sizeof(dir), path, sizeof(path), key);
+	if (!(cf = fopen(path, "r")))
+		return 0;
+
+	if (!key_matches(cf, key)) {
+		fclose(cf);
+		return 0;
+	}
+
+	while (fgets(buf, sizeof(buf), cf) != NULL && strcmp(buf, "\n"))
+		hprintf("%s", buf);
+	if (fstat(fileno(cf), &st) == 0 &&
+	    (len = st.st_size - ftell(cf)) > CACHE_STREAM)
+		resp_stream(len);
+
+	while ((n = fread(buf, 1, sizeof(buf), cf)) > 0)
+		bput(buf, n);
+	if (ferror(cf))
+		weprintf("fread %s:", path);
+	fclose(cf);
+
+	/* Eviction goes by mtime, so mark the page as recently used */
+	utimes(path, NULL);
+
+	return 1;
+}
+
+static int
+entrycmp(const void *va, const void *vb)
+{
+	const struct entry *a = va, *b = vb;
+
+	return (a->mtime > b->mtime) - (a->mtime < b->mtime);
+}
+
+/*
+ * Evicts the least recently used pages of a shard beyond its share,
+ * sparing the most recent one which was just written. Returns the bytes
+ * of the pages left.
+ */
+static uint64_t
+evict(const char *dir)
+{
+	char path[PATH_MAX + NAME_MAX + 2];
+	struct entry *ents = NULL, *e;
+	struct dirent *d;
+	struct stat st;
+	uint64_t total = 0;
+	size_t i, n = 0, cap = 0;
+	DIR *dp;
+
+	if (!(dp = opendir(dir)))
+		return 0;
+
+	while ((d = readdir(dp))) {
+		if (d->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, d->d_name);
+		if (stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+			continue;
+		if (n == cap) {
+			cap = cap ? cap * 2 : 256;
+			if (!(ents = reallocarray(ents, cap, sizeof(*ents))))
+				eprintf("reallocarray:");
+		}
+		e = &ents[n++];
+		strlcpy(e->name, d->d_name, sizeof(e->name));
+		e->size = st.st_size;
+		e->mtime = st.st_mtime;
+		total += st.st_size;
+	}
+	closedir(dp);
+
+	if (total > PAGE_CACHE_MAX / NSHARDS) {
+		qsort(ents, n, sizeof(*ents), entrycmp);
+		for (i = 0; i + 1 < n && total > PAGE_CACHE_MAX / NSHARDS;
+		    i++) {
+			snprintf(path, sizeof(path), "%s/%s", dir,
+			    ents[i].name);
+			if (unlink(path) == 0)
+				total -= ents[i].size;
+		}
+	}
+
+	free(ents);
+	return total;
+}
+
+/*
+ * Adds delta to the bytes of pages a shard keeps in its .size file,
+ * evicting pages once they exceed its share, so its pages are only
+ * listed then. The count is updated under a lock, writers being in
+ * other processes too. A missing count is made again by listing them.
+ */
+static void
+account(const char *dir, int64_t delta)
+{
+	char path[PATH_MAX + 8];
+	uint64_t total;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/.size", dir);
+	if ((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0) {
+		weprintf("open %s:", path);
+		return;
+	}
+	if (flock(fd, LOCK_EX) < 0) {
+		weprintf("flock %s:", path);
+		close(fd);
+		return;
+	}
+
+	if (pread(fd, &total, sizeof(total), 0) != sizeof(total)) {
+		total = evict(dir);
+	} else {
+		if (delta < 0 && (uint64_t)-delta > total)
+			total = 0;
+		else
+			total += delta;
+		if (total > PAGE_CACHE_MAX / NSHARDS)
+			total = evict(dir);
+	}
+
+	if (pwrite(fd, &total, sizeof(total), 0) != sizeof(total))
+		weprintf("pwrite %s:", path);
+	close(fd);
+}
+
+/*
+ * Opens a temporary file for the page of key in its shard, to be moved
+ * into place by cache_commit() once it is complete.
+ */
+FILE *
+cache_create(const char *key, char *tmp, size_t n)
+{
+	char dir[PATH_MAX], path[PATH_MAX];
+	FILE *fp;
+	int fd;
+
+	if (strchr(key, '\n') || strlen(key) > CACHE_KEY_MAX)
+		return NULL;
+
+	page_path(dir, sizeof(dir), path, sizeof(path), key);
+
+	if (mkdir(PAGES_DIR, 0755) < 0 && errno != EEXIST) {
+		weprintf("mkdir %s:", PAGES_DIR);
+		return NULL;
+	}
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+		weprintf("mkdir %s:", dir);
+		return NULL;
+	}
+
+	snprintf(tmp, n, "%s/.XXXXXX", dir);
+	if ((fd = mkstemp(tmp)) < 0) {
+		weprintf("mkstemp %s:", tmp);
+		return NULL;
+	}
+	if (!(fp = fdopen(fd, "w"))) {
+		weprintf("fdopen %s:", tmp);
+		close(fd);
+		unlink(tmp);
+		return NULL;
+	}
+
+	fprintf(fp, "%s\n", key);
+
+	return fp;
+}
+
+void
+cache_commit(const char *key, FILE *fp, const char *tmp)
+{
+	char dir[PATH_MAX], path[PATH_MAX];
+	struct stat st;
+	off_t size, old;
+
+	page_path(dir, sizeof(dir), path, sizeof(path), key);
+
+	if (fclose(fp) == EOF || stat(tmp, &st) < 0) {
+		weprintf("fclose %s:", tmp);
+		unlink(tmp);
+		return;
+	}
+	size = st.st_size;
+	/* A page replaced gives its bytes back */
+	old = stat(path, &st) == 0 ? st.st_size : 0;
+	if (rename(tmp, path) < 0) {
+		weprintf("rename %s:", tmp);
+		unlink(tmp);
+		return;
+	}
+
+	account(dir, (int64_t)size - old);
+}
+
+void
+cache_put(const char *key, const struct buf *head, const struct buf *body)
+{
+	char tmp[PATH_MAX + 16];
+	FILE *fp;
+
+	if ((fp = cache_create(key, tmp, sizeof(tmp))) == NULL)
+		return;
+	fwrite(head->s, 1, head->len, fp);
+	putc('\n', fp);
+	fwrite(body->s, 1, body->len, fp);
+	cache_commit(key, fp, tmp);
+}
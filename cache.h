@@ -0,0 +1,4 @@
+int cache_get(const char *);
+void cache_put(const char *, const struct buf *, const struct buf *);
+FILE *cache_create(const char *, char *, size_t);
+void cache_commit(const char *, FILE *, const char *);
@@ -2,8 +2,49 @@ INCS = -I../libgit2/include
 LIBS = -L../libgit2/build -lgit2 -lpthread -lz -lc
 
 SCAN_DIR = /git
+CACHE_DIR = /cache
 
-CPPFLAGS = -D_BSD_SOURCE -DSCAN_DIR=\"${SCAN_DIR}\"
+# Repositories inspected in parallel for the index page
+INDEX_JOBS = 8
+
+# Worker threads of the HTTP server
+HTTP_JOBS = 8
+
+# Processes serving FastCGI or HTTP requests, 0 serves them from one;
+# each is replaced after so many requests or once it has grown to so
+# many kilobytes
+WORKERS = 4
+WORKER_REQUESTS = 100000
+WORKER_RSS_MAX = 524288
+
+# Bytes of rendered pages kept under CACHE_DIR/pages, 0 disables
+PAGE_CACHE_MAX = 0
+
+# Limits of a commit page, larger diffs link to per file pages
+DIFF_MAX_FILES = 1000
+DIFF_MAX_LINES = 20000
+DIFF_MAX_FILE_BYTES = 1048576
+
+# Bytes of a file shown in the tree, larger files link to the raw view
+BLOB_MAX_BYTES = 4194304
+
+# Level of response compression and the smallest body worth compressing
+GZIP_LEVEL = 6
+GZIP_MIN = 1024
+
+# Log a line of timings and counts to stderr for each request, 0 disables
+TIMING_LOG = 0
+
+CPPFLAGS = -D_BSD_SOURCE -DSCAN_DIR=\"${SCAN_DIR}\" -DCACHE_DIR=\"${CACHE_DIR}\" \
+    -DINDEX_JOBS=${INDEX_JOBS} -DHTTP_JOBS=${HTTP_JOBS} \
+    -DWORKERS=${WORKERS} -DWORKER_REQUESTS=${WORKER_REQUESTS} \
+    -DWORKER_RSS_MAX=${WORKER_RSS_MAX} \
+    -DPAGE_CACHE_MAX=${PAGE_CACHE_MAX} \
+    -DDIFF_MAX_FILES=${DIFF_MAX_FILES} -DDIFF_MAX_LINES=${DIFF_MAX_LINES} \
+    -DDIFF_MAX_FILE_BYTES=${DIFF_MAX_FILE_BYTES} \
+    -DBLOB_MAX_BYTES=${BLOB_MAX_BYTES} \
+    -DGZIP_LEVEL=${GZIP_LEVEL} -DGZIP_MIN=${GZIP_MIN} \
+    -DTIMING_LOG=${TIMING_LOG}
 CFLAGS = -Os -std=c99 -Wall -Wextra -pedantic ${CPPFLAGS} ${INCS}
 LDFLAGS = -s -static ${LIBS}
 
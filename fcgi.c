@@ -0,0 +1,469 @@
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "compat.h"
+#include "fcgi.h"
+#include "util.h"
+#include "resp.h"
+
+#define FCGI_VERSION_1 1
+
+#define FCGI_BEGIN_REQUEST 1
+#define FCGI_ABORT_REQUEST 2
+#define FCGI_END_REQUEST 3
+#define FCGI_PARAMS 4
+#define FCGI_STDIN 5
+#define FCGI_STDOUT 6
+#define FCGI_GET_VALUES 9
+#define FCGI_GET_VALUES_RESULT 10
+#define FCGI_UNKNOWN_TYPE 11
+
+#define FCGI_RESPONDER 1
+#define FCGI_KEEP_CONN 1
+
+#define FCGI_REQUEST_COMPLETE 0
+#define FCGI_CANT_MPX_CONN 1
+#define FCGI_UNKNOWN_ROLE 3
+
+#define FCGI_HEADER_LEN 8
+#define FCGI_CONTENT_MAX 65535
+#define FCGI_CHUNK 32768
+/* Bytes of the PARAMS stream of a request accepted at most */
+#define FCGI_PARAMS_MAX (1 << 20)
+/* Seconds a connection may wait for its next request */
+#define FCGI_IDLE 30
+
+struct fcgi_header {
+	unsigned char version;
+	unsigned char type;
+	unsigned char id[2];
+	unsigned char len[2];
+	unsigned char padlen;
+	unsigned char reserved;
+};
+
+struct fcgi_rec {
+	int type;
+	unsigned int id;
+	size_t len;
+	unsigned char buf[FCGI_CONTENT_MAX + 255];
+};
+
+struct fcgi_out {
+	int fd;
+	unsigned int id;
+};
+
+/* Request parameters stored as consecutive name\0value\0 pairs */
+static struct {
+	char *buf;
+	size_t len;
+	size_t cap;
+} params;
+
+/*
+ * The PARAMS stream as received, pairs being free to span records. It
+ * is parsed once the empty record ending it arrives.
+ */
+static struct {
+	unsigned char *buf;
+	size_t len;
+	size_t cap;
+} raw;
+
+/* Set once the handler asks to stop after its response */
+static int stopping;
+
+int
+fcgi_listen(const char *path)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlcpy(sun.sun_path, path, sizeof(sun.sun_path)) >=
+	    sizeof(sun.sun_path))
+		eprintf("socket path too long: %s\n", path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		eprintf("socket:");
+	if (unlink(path) < 0 && errno != ENOENT)
+		eprintf("unlink %s:", path);
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+		eprintf("bind %s:", path);
+	if (listen(fd, SOMAXCONN) < 0)
+		eprintf("listen %s:", path);
+
+	return fd;
+}
+
+static int
+readn(int fd, void *buf, size_t n)
+{
+	unsigned char *p = buf;
+	ssize_t r;
+
+	while (n > 0) {
+		if ((r = read(fd, p, n)) < 0) {
+			if (errno == EINTR)
+				continue;
+			weprintf("read:");
+			return -1;
+		}
+		if (r == 0)
+			return -1;
+		p += r;
+		n -= r;
+	}
+	return 0;
+}
+
+static int
+writen(int fd, const void *buf, size_t n)
+{
+	const unsigned char *p = buf;
+	ssize_t r;
+
+	while (n > 0) {
+		if ((r = write(fd, p, n)) < 0) {
+			if (errno == EINTR)
+				continue;
+			weprintf("write:");
+			return -1;
+		}
+		p += r;
+		n -= r;
+	}
+	return 0;
+}
+
+static int
+read_rec(int fd, struct fcgi_rec *rec)
+{
+	struct fcgi_header h;
+
+	if (readn(fd, &h, sizeof(h)) < 0)
+		return -1;
+	if (h.version != FCGI_VERSION_1) {
+		weprintf("fcgi: unsupported version %d\n", h.version);
+		return -1;
+	}
+	rec->type = h.type;
+	rec->id = (h.id[0] << 8) | h.id[1];
+	rec->len = (h.len[0] << 8) | h.len[1];
+
+	return readn(fd, rec->buf, rec->len + h.padlen);
+}
+
+static int
+write_rec(int fd, int type, unsigned int id, const void *buf, size_t len)
+{
+	struct fcgi_header h;
+
+	h.version = FCGI_VERSION_1;
+	h.type = type;
+	h.id[0] = (id >> 8) & 0xff;
+	h.id[1] = id & 0xff;
+	h.len[0] = (len >> 8) & 0xff;
+	h.len[1] = len & 0xff;
+	h.padlen = 0;
+	h.reserved = 0;
+
+	if (writen(fd, &h, sizeof(h)) < 0)
+		return -1;
+	return len > 0 ? writen(fd, buf, len) : 0;
+}
+
+static int
+write_end(int fd, unsigned int id, int status)
+{
+	unsigned char body[8];
+
+	memset(body, 0, sizeof(body));
+	body[4] = status;
+
+	return write_rec(fd, FCGI_END_REQUEST, id, body, sizeof(body));
+}
+
+static int
+write_stdout(int fd, unsigned int id, const char *buf, size_t len)
+{
+	size_t n;
+
+	while (len > 0) {
+		n = len > FCGI_CHUNK ? FCGI_CHUNK : len;
+		if (write_rec(fd, FCGI_STDOUT, id, buf, n) < 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Response sink wrapping what it is given in FCGI_STDOUT records */
+static int
+stdout_sink(void *arg, const struct iovec *iov, int n)
+{
+	const struct fcgi_out *o = arg;
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (write_stdout(o->fd, o->id, iov[i].iov_base,
+		    iov[i].iov_len) < 0)
+			return -1;
+	return 0;
+}
+
+static size_t
+nvlen(const unsigned char **p, const unsigned char *end)
+{
+	size_t n;
+
+	if (*p >= end)
+		return SIZE_MAX;
+	if (!(**p & 0x80))
+		return *(*p)++;
+	if (end - *p < 4)
+		return SIZE_MAX;
+	n = ((size_t)((*p)[0] & 0x7f) << 24) | ((size_t)(*p)[1] << 16) |
+	    ((size_t)(*p)[2] << 8) | (*p)[3];
+	*p += 4;
+
+	return n;
+}
+
+static void
+params_add(const unsigned char *s, size_t n)
+{
+	char *p;
+
+	if (params.len + n + 1 > params.cap) {
+		params.cap = (params.len + n + 1) * 2;
+		if (!(p = realloc(params.buf, params.cap)))
+			eprintf("realloc:");
+		params.buf = p;
+	}
+	memcpy(params.buf + params.len, s, n);
+	params.len += n;
+	params.buf[params.len++] = '\0';
+}
+
+static int
+raw_add(const unsigned char *s, size_t n)
+{
+	unsigned char *p;
+
+	if (raw.len + n > FCGI_PARAMS_MAX)
+		return -1;
+	if (raw.len + n > raw.cap) {
+		raw.cap = (raw.len + n) * 2;
+		if (!(p = realloc(raw.buf, raw.cap)))
+			eprintf("realloc:");
+		raw.buf = p;
+	}
+	memcpy(raw.buf + raw.len, s, n);
+	raw.len += n;
+	return 0;
+}
+
+static int
+parse_params(const unsigned char *p, size_t len)
+{
+	const unsigned char *end = p + len;
+	size_t nlen, vlen;
+
+	while (p < end) {
+		if ((nlen = nvlen(&p, end)) == SIZE_MAX ||
+		    (vlen = nvlen(&p, end)) == SIZE_MAX ||
+		    nlen + vlen > (size_t)(end - p))
+			return -1;
+		params_add(p, nlen);
+		params_add(p + nlen, vlen);
+		p += nlen + vlen;
+	}
+	return 0;
+}
+
+char *
+fcgi_getparam(const char *name)
+{
+	char *p, *end;
+
+	for (p = params.buf, end = p + params.len; p < end; ) {
+		if (!strcmp(p, name))
+			return p + strlen(p) + 1;
+		p += strlen(p) + 1;
+		p += strlen(p) + 1;
+	}
+	return NULL;
+}
+
+static int
+respond(int fd, unsigned int id, int (*handler)(void))
+{
+	struct fcgi_out o;
+
+	o.fd = fd;
+	o.id = id;
+	resp_begin(stdout_sink, &o);
+	stopping = handler();
+	if (resp_end() < 0 || write_rec(fd, FCGI_STDOUT, id, NULL, 0) < 0)
+		return -1;
+
+	return write_end(fd, id, FCGI_REQUEST_COMPLETE);
+}
+
+static void
+get_values(int fd, const struct fcgi_rec *rec)
+{
+	static const unsigned char res[] = {
+		14, 1, 'F','C','G','I','_','M','A','X','_','C','O','N','N','S',
+		'1',
+		13, 1, 'F','C','G','I','_','M','A','X','_','R','E','Q','S',
+		'1',
+		15, 1, 'F','C','G','I','_','M','P','X','S','_','C','O','N','N',
+		'S', '0'
+	};
+
+	write_rec(fd, FCGI_GET_VALUES_RESULT, rec->id, res, sizeof(res));
+}
+
+/*
+ * Waits for fd to begin its next request, returning -1 once it is to be
+ * closed: after FCGI_IDLE seconds, or as soon as connections wait on
+ * lfd while fd is idle, since a process serves one connection at a
+ * time. lfd is -1 for it to be left out.
+ */
+static int
+wait_request(int fd, int lfd)
+{
+	struct pollfd pfd[2];
+	int n;
+
+	pfd[0].fd = fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = lfd;
+	pfd[1].events = POLLIN;
+
+	while ((n = poll(pfd, 2, FCGI_IDLE * 1000)) < 0)
+		if (errno != EINTR) {
+			weprintf("poll:");
+			return -1;
+		}
+	return n > 0 && pfd[0].revents ? 0 : -1;
+}
+
+/*
+ * Answers the requests of fd in turn. Kept connections are given up
+ * between requests for those waiting on lfd.
+ */
+static void
+serve_conn(int fd, int lfd, int (*handler)(void))
+{
+	static struct fcgi_rec rec;
+	unsigned char unknown[8];
+	unsigned int id = 0;
+	int keep = 0, served = 0;
+
+	for (;;) {
+		if (id == 0 && wait_request(fd, served ? lfd : -1) < 0)
+			return;
+		if (read_rec(fd, &rec) < 0)
+			return;
+
+		if (rec.id == 0) {
+			if (rec.type == FCGI_GET_VALUES) {
+				get_values(fd, &rec);
+			} else {
+				memset(unknown, 0, sizeof(unknown));
+				unknown[0] = rec.type;
+				write_rec(fd, FCGI_UNKNOWN_TYPE, 0, unknown,
+				    sizeof(unknown));
+			}
+			continue;
+		}
+
+		switch (rec.type) {
+		case FCGI_BEGIN_REQUEST:
+			if (rec.len < 8)
+				return;
+			if (id != 0) {
+				write_end(fd, rec.id, FCGI_CANT_MPX_CONN);
+				continue;
+			}
+			if (((rec.buf[0] << 8) | rec.buf[1]) != FCGI_RESPONDER) {
+				write_end(fd, rec.id, FCGI_UNKNOWN_ROLE);
+				continue;
+			}
+			id = rec.id;
+			keep = rec.buf[2] & FCGI_KEEP_CONN;
+			params.len = 0;
+			raw.len = 0;
+			break;
+		case FCGI_PARAMS:
+			if (rec.id != id)
+				continue;
+			if (rec.len > 0) {
+				if (raw_add(rec.buf, rec.len) < 0) {
+					weprintf("fcgi: params too large\n");
+					return;
+				}
+				continue;
+			}
+			if (parse_params(raw.buf, raw.len) < 0) {
+				weprintf("fcgi: malformed params\n");
+				return;
+			}
+			break;
+		case FCGI_STDIN:
+			if (rec.id != id || rec.len > 0)
+				continue;
+			if (respond(fd, id, handler) < 0 || !keep || stopping)
+				return;
+			id = 0;
+			served = 1;
+			break;
+		case FCGI_ABORT_REQUEST:
+			if (rec.id != id)
+				continue;
+			if (write_end(fd, id, FCGI_REQUEST_COMPLETE) < 0 ||
+			    !keep)
+				return;
+			id = 0;
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+/*
+ * Answers requests on connections accepted from lfd, one at a time,
+ * until handler returns nonzero.
+ */
+void
+fcgi_serve(int lfd, int (*handler)(void))
+{
+	int fd;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	while (!stopping) {
+		if ((fd = accept(lfd, NULL, NULL)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			eprintf("accept:");
+		}
+		serve_conn(fd, lfd, handler);
+		close(fd);
+	}
+}
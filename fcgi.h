@@ -0,0 +1,3 @@
+int fcgi_listen(const char *);
+void fcgi_serve(int, int (*)(void));
+char *fcgi_getparam(const char *);
@@ -1,192 +1,451 @@
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include <ctype.h>
 #include <dirent.h>
 #include <inttypes.h>
 #include <libgen.h>
 #include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
 
+#include "build.h"
 #include "compat.h"
+#include "fcgi.h"
+#include "http.h"
+#include "prefork.h"
 #include "style.h"
 #include "util.h"
+#include "arena.h"
+#include "resp.h"
+#include "archive.h"
+#include "cache.h"
+#include "repos.h"
+#include "graph.h"
+#include "timing.h"
 
-#define REPO_NAME_MAX 64
 #define OBJ_ABBREV 7
 #define TITLE_MAX 50
+#define CHILD_MAX 16
 #define LOG_PER_PAGE 1000
+#define TREE_PER_PAGE 1000
+#define REFS_PER_PAGE 1000
+#define REFS_SUMMARY 10
+#define ETAG_MAX (2 * GIT_OID_HEXSZ + 64)
 
-struct repo {
-	char path[PATH_MAX];
-	char name[REPO_NAME_MAX];
-	git_time_t age;
-	git_repository *handle;
-};
-
-struct repos {
+struct ageq {
+	struct repo **todo;
 	size_t n;
-	struct repo *repos;
+	size_t next;
+	pthread_mutex_t lock;
+	uint64_t count[COUNT_MAX];
 };
 
+/* Keep repositories and their handles open across requests */
+static int persist;
+static char *(*getparam)(const char *) = getenv;
+
+/* Validator of the page being rendered, sent with its headers */
+static __thread char etag[ETAG_MAX];
+static __thread int immutable;
+
+/* Page to be put in the page cache once it is rendered */
+static __thread char cachekey[PATH_MAX + ETAG_MAX];
+static __thread int caching;
+
+/* Temporary file of an archive being copied to the page cache */
+static __thread char copytmp[PATH_MAX + 16];
+
+/* Repository being served, and where its handle is kept between requests */
+static __thread struct repo cur;
+static __thread git_repository **curh;
+
 static int
-has_file(const char *base, const char *file, int isdir)
+parse_repo(struct repo *rp)
 {
-	char buf[PATH_MAX];
-	struct stat st;
+	git_reference *ref;
+	git_commit *ci;
 
-	snprintf(buf, sizeof(buf), "%s/%s", base, file);
-	if (stat(buf, &st) < 0) {
-		if (errno != ENOENT)
-			eprintf("stat %s:", buf);
-		return 0;
+	if (rp->handle == NULL &&
+	    git_repository_open_bare(&rp->handle, rp->path)) {
+		gweprintf("repo open %s:", rp->path);
+		rp->handle = NULL;
+		return -1;
+	}
+	if (git_repository_head(&ref, rp->handle)) {
+		gweprintf("repo head %s:", rp->path);
+		return -1;
+	}
+	if (git_commit_lookup(&ci, rp->handle, git_reference_target(ref))) {
+		gweprintf("commit lookup %s:", rp->path);
+		git_reference_free(ref);
+		return -1;
 	}
-	return isdir ? S_ISDIR(st.st_mode) : S_ISREG(st.st_mode);
+	timing_count(COUNT_OBJECTS, 1);
+
+	rp->age = git_commit_time(ci);
+
+	git_commit_free(ci);
+	git_reference_free(ref);
+
+	return 0;
 }
 
-static int
-valid_git_dir(const char *dir)
+static void
+close_repo(struct repo *rp)
 {
-	return has_file(dir, "objects", 1) &&
-	    has_file(dir, "HEAD", 0) &&
-	    has_file(dir, "refs", 1);
+	if (persist)
+		return;
+	git_repository_free(rp->handle);
+	rp->handle = NULL;
 }
 
 static void
-set_repo_name(const struct repo *rp) {
-	const char *p;
+close_repos(const struct repos *rsp)
+{
+	size_t i;
 
-	if (strncmp(rp->path, SCAN_DIR"/", strlen(SCAN_DIR"/")) != 0)
-		eprintf("repo path not subdir of SCAN_DIR\n");
+	for (i = 0; i < rsp->n; i++)
+		if (rsp->repos[i].handle != NULL) {
+			git_repository_free(rsp->repos[i].handle);
+			rsp->repos[i].handle = NULL;
+		}
+}
+
+static void *
+age_worker(void *arg)
+{
+	struct ageq *q = arg;
+	struct repo *rp;
+
+	for (;;) {
+		pthread_mutex_lock(&q->lock);
+		rp = q->next < q->n ? q->todo[q->next++] : NULL;
+		pthread_mutex_unlock(&q->lock);
+
+		if (rp == NULL)
+			return NULL;
+		parse_repo(rp);
+		close_repo(rp);
+	}
+}
+
+/* A worker of its own thread, whose counts go to the request's at the end */
+static void *
+age_thread(void *arg)
+{
+	struct ageq *q = arg;
 
-	p = rp->path + strlen(SCAN_DIR"/");
-	strlcpy((char *)rp->name, p, sizeof(rp->name));
+	age_worker(q);
+	pthread_mutex_lock(&q->lock);
+	timing_counts(q->count);
+	pthread_mutex_unlock(&q->lock);
+	return NULL;
 }
 
 static void
-find_repos(struct repos *rsp, const char *dir, int depth)
+parse_repos(const struct repos *rsp)
 {
-	DIR *dp;
-	struct dirent *d;
-	char buf[PATH_MAX];
+	pthread_t tids[INDEX_JOBS];
+	struct ageq q;
 	struct repo *rp;
+	time_t stamp;
+	size_t i, njobs;
 
-	if (depth >= 3)
-		return;
-	depth++;
-
-	if (!(dp = opendir(dir)))
-		eprintf("opendir %s:", dir);
+	q.todo = arena_array(rsp->n, sizeof(*q.todo));
+	q.n = 0;
+	q.next = 0;
+	memset(q.count, 0, sizeof(q.count));
 
-	while ((d = readdir(dp))) {
-		if (strcmp(d->d_name, ".") == 0 ||
-		    strcmp(d->d_name, "..") == 0)
+	for (i = 0; i < rsp->n; i++) {
+		rp = &rsp->repos[i];
+		if ((stamp = repo_stamp(rp)) == rp->stamp)
 			continue;
+		rp->stamp = stamp;
+		q.todo[q.n++] = rp;
+	}
 
-		if (valid_git_dir(dir)) {
-			rsp->repos = reallocarray(rsp->repos, ++rsp->n,
-			    sizeof(struct repo));
-			if (rsp->repos == NULL)
-				eprintf("reallocarray:");
-			rp = &rsp->repos[rsp->n - 1];
-			strlcpy(rp->path, dir, PATH_MAX);
-			set_repo_name(rp);
+	if (q.n == 0)
+		return;
+
+	pthread_mutex_init(&q.lock, NULL);
+
+	/* The calling thread is the last worker */
+	for (njobs = 0; njobs + 1 < INDEX_JOBS && njobs + 1 < q.n; njobs++)
+		if ((errno = pthread_create(&tids[njobs], NULL, age_thread,
+		    &q))) {
+			weprintf("pthread_create:");
 			break;
 		}
+	age_worker(&q);
+	for (i = 0; i < njobs; i++)
+		pthread_join(tids[i], NULL);
+	for (i = 0; i < COUNT_MAX; i++)
+		timing_count(i, q.count[i]);
 
-		snprintf(buf, sizeof(buf), "%s/%s", dir, d->d_name);
-		if (has_file(dir, d->d_name, 1))
-			find_repos(rsp, buf, depth);
-	}
+	pthread_mutex_destroy(&q.lock);
 
-	closedir(dp);
+	repos_save(rsp);
 }
 
 static int
-parse_repo(struct repo *rp)
+repocmp(const void *va, const void *vb)
 {
-	git_repository *r;
-	git_reference *ref;
-	git_commit *ci;
+	const struct repo *a = *(struct repo **)va, *b = *(struct repo **)vb;
+	return (a->age < b->age) - (a->age > b->age);
+}
 
-	if (git_repository_open_bare(&r, rp->path))
-		geprintf("repo open %s:", rp->path);
-	if (git_repository_head(&ref, r)) {
-		gweprintf("repo head %s:", rp->path);
-		return -1;
-	}
-	if (git_commit_lookup(&ci, r, git_reference_target(ref)))
-		geprintf("commit lookup %s:", rp->path);
+/* Sets the header fields common to every response */
+static void
+http_fields(const char *status, const char *type)
+{
+	hprintf("Content-Type: %s\n"
+	    "Status: %s\n", type, status);
+	if (etag[0] != '\0')
+		hprintf("ETag: %s\n", etag);
+	if (immutable)
+		hprintf("Cache-Control: public, max-age=31536000, immutable\n");
+	if (!strncmp(type, "text/", 5))
+		hprintf("Vary: Accept-Encoding\n");
+}
 
-	rp->age = git_commit_time(ci);
-	rp->handle = r;
+static void
+http_headers(const char *status)
+{
+	http_fields(status, "text/html; charset=UTF-8");
+}
 
-	git_reference_free(ref);
+static int
+etag_match(const char *list, const char *tag)
+{
+	const char *p;
+	size_t n;
 
+	/* Tags of compressed bodies carry the coding before the quote */
+	n = strlen(tag) - 1;
+	for (p = list; *p; ) {
+		p += strspn(p, " \t,");
+		if (p[0] == '*')
+			return 1;
+		if (p[0] == 'W' && p[1] == '/')
+			p += 2;
+		if (!strncmp(p, tag, n) && (!strncmp(p + n, "\"", 1) ||
+		    !strncmp(p + n, "-gzip\"", 6) ||
+		    !strncmp(p + n, "-deflate\"", 9)))
+			return 1;
+		p += strcspn(p, ",");
+	}
 	return 0;
 }
 
+/* Whether the Accept-Encoding list takes coding at a non-zero quality */
+static int
+accepts(const char *list, const char *coding)
+{
+	const char *p, *q;
+	size_t n, k;
+	int star = 0;
+
+	n = strlen(coding);
+	for (p = list; *p; p += strcspn(p, ",")) {
+		p += strspn(p, " \t,");
+		k = strcspn(p, " \t;,");
+		q = p + k + strspn(p + k, " \t");
+		if (*q == ';' && (q = strstr(q, "q=")) != NULL &&
+		    q < p + strcspn(p, ",") && strtod(q + 2, NULL) == 0) {
+			if (k == n && !strncasecmp(p, coding, n))
+				return 0;
+			continue;
+		}
+		if (k == n && !strncasecmp(p, coding, n))
+			return 1;
+		if (k == 1 && p[0] == '*')
+			star = 1;
+	}
+	return star;
+}
+
+/*
+ * Sets the validator for the page about to be rendered from the object
+ * ids it depends on and answers with 304 if the client already has it.
+ */
+static int
+not_modified(char kind, const git_oid *id, const char *extra, int imm)
+{
+	char hex[GIT_OID_HEXSZ + 1];
+	const char *inm;
+
+	git_oid_tostr(hex, sizeof(hex), id);
+	snprintf(etag, sizeof(etag), "\"%c-%s%s%s-%s\"", kind, hex,
+	    extra ? "-" : "", extra ? extra : "", BUILD_ID);
+	immutable = imm;
+
+	if ((inm = getparam("HTTP_IF_NONE_MATCH")) == NULL ||
+	    !etag_match(inm, etag))
+		return 0;
+
+	http_headers("304 Not Modified");
+	resp_nolength();
+	return 1;
+}
+
+/* Names the page by its URL and validator */
 static void
-parse_repos(const struct repos *rsp)
+set_cachekey(void)
 {
-	size_t i;
+	const char *url, *qs;
 
-	for (i = 0; i < rsp->n; i++) {
-		parse_repo(&rsp->repos[i]);
-		git_repository_free(rsp->repos[i].handle);
-	}
+	url = getparam("PATH_INFO");
+	qs = getparam("QUERY_STRING");
+	snprintf(cachekey, sizeof(cachekey), "%s?%s %s", url,
+	    qs ? qs : "", etag);
 }
 
+/*
+ * Serves the page for the current validator from the page cache, or
+ * marks it to be put there once the response is complete.
+ */
 static int
-repocmp(const void *va, const void *vb)
+cached(void)
 {
-	const struct repo *a = va, *b = vb;
-	return b->age - a->age;
+	if (PAGE_CACHE_MAX == 0)
+		return 0;
+
+	set_cachekey();
+	if (cache_get(cachekey))
+		return 1;
+	caching = 1;
+
+	return 0;
 }
 
 static void
-http_headers(const char *status)
+cache_flush(void)
+{
+	if (!caching)
+		return;
+	caching = 0;
+
+	cache_put(cachekey, resp_head(), resp_body());
+}
+
+static int
+is_full_id(const char *s)
+{
+	size_t i;
+
+	for (i = 0; i < GIT_OID_HEXSZ; i++)
+		if (!isxdigit((unsigned char)s[i]))
+			return 0;
+	return s[i] == '\0';
+}
+
+static int
+head_id(const struct repo *rp, git_oid *id)
 {
-	printf("Content-Type: text/html; charset=UTF-8\n"
-	    "Status: %s\n\n", status);
+	git_reference *ref;
+
+	if (git_repository_head(&ref, rp->handle))
+		return -1;
+	git_oid_cpy(id, git_reference_target(ref));
+	git_reference_free(ref);
+
+	return 0;
 }
 
 static void
 render_header(const char *title, const char *id)
 {
-	printf("<!doctype html>\n"
+	bprintf("<!doctype html>\n"
 	    "<html>\n<head>\n"
 	    "<title>%s</title>\n"
-	    "<style type=text/css>%s</style>\n"
-	    "</head>\n<body id=%s>\n", title, STYLE, id);
+	    "<link rel=stylesheet href=/_static/style.%s.css>\n"
+	    "</head>\n<body id=%s>\n", title, STYLE_HASH, id);
 }
 
 static void
 render_title(const char *title)
 {
-	printf("<h1>%s</h1>\n", title);
+	bprintf("<h1>%s</h1>\n", title);
 }
 
 static void
 render_footer(void)
 {
-	puts("</body>\n</html>");
+	bputs("</body>\n</html>\n");
 }
 
+/*
+ * A page may turn out to be missing after its validator was set, as a
+ * file past the end of a commit's diff: the 404 is not kept anywhere.
+ */
 static void
 render_notfound(void)
 {
+	caching = 0;
+	etag[0] = '\0';
+	immutable = 0;
 	http_headers("404 Not Found");
 	render_header("404 Not Found", "404");
 	render_title("404 Not Found");
 	render_footer();
 }
 
+static void
+render_error(void)
+{
+	http_headers("500 Internal Server Error");
+	render_header("500 Internal Server Error", "500");
+	render_title("500 Internal Server Error");
+	render_footer();
+}
+
+/*
+ * Serves the stylesheet under a name carrying the hash of its content,
+ * so it can be cached for good, gzipped at build time if the client
+ * takes it.
+ */
+static void
+render_static(const char *name)
+{
+	const char *ae, *inm;
+	int gz;
+
+	timing_route("static");
+
+	if (strcmp(name, "style." STYLE_HASH ".css")) {
+		render_notfound();
+		return;
+	}
+	gz = (ae = getparam("HTTP_ACCEPT_ENCODING")) != NULL &&
+	    accepts(ae, "gzip");
+	snprintf(etag, sizeof(etag), "\"y-%s%s\"", STYLE_HASH,
+	    gz ? "-gzip" : "");
+	immutable = 1;
+	resp_compress(NULL);
+
+	if ((inm = getparam("HTTP_IF_NONE_MATCH")) != NULL &&
+	    etag_match(inm, etag)) {
+		http_fields("304 Not Modified", "text/css");
+		resp_nolength();
+		return;
+	}
+
+	http_fields("200 Success", "text/css");
+	if (gz) {
+		hprintf("Content-Encoding: gzip\n");
+		bput(STYLE_GZ, sizeof(STYLE_GZ));
+	} else
+		bputs(STYLE);
+}
+
 static void
 render_index_line(const struct repo *rp)
 {
-	puts("<tr>\n<td>");
+	bputs("<tr>\n<td>\n");
 	printgt(rp->age);
-	printf("</td>\n"
+	bprintf("</td>\n"
 	    "<td><a href=/%s>%s</a></td>\n"
 	    "</tr>\n", rp->name, rp->name);
 }
@@ -194,454 +453,784 @@ render_index_line(const struct repo *rp)
 static void
 render_index(const struct repos *rsp)
 {
+	struct repo **sorted;
 	size_t i;
 
+	timing_route("index");
+
+	timing_start(TIMER_OPEN);
 	parse_repos(rsp);
-	qsort(rsp->repos, rsp->n, sizeof(*rsp->repos), repocmp);
+	timing_stop(TIMER_OPEN);
+
+	sorted = arena_array(rsp->n, sizeof(*sorted));
+	for (i = 0; i < rsp->n; i++)
+		sorted[i] = &rsp->repos[i];
+	qsort(sorted, rsp->n, sizeof(*sorted), repocmp);
 
 	http_headers("200 Success");
 	render_header("Index", "index");
 	render_title("Index");
 	if (rsp->n > 0) {
-		puts("<table>\n"
+		bputs("<table>\n"
 		    "<tr>\n"
 		    "<th>Latest commit</th>\n"
 		    "<th>Name</th>"
-		    "</tr>");
+		    "</tr>\n");
 		for (i = 0; i < rsp->n; i++)
-			render_index_line(&rsp->repos[i]);
-		puts("</table>");
+			render_index_line(sorted[i]);
+		bputs("</table>\n");
 	} else
-		puts("<p>No repositories</p>");
+		bputs("<p>No repositories</p>\n");
 	render_footer();
 }
 
 static void
-render_log_link(const struct repo *rp, const git_commit *ci)
+render_log_link(const struct repo *rp, const git_oid *start, size_t offset)
 {
 	char hex[GIT_OID_HEXSZ + 1];
 
-	git_oid_tostr(hex, sizeof(hex), git_commit_id(ci));
+	git_oid_tostr(hex, sizeof(hex), start);
 
-	printf("<tr>\n"
+	bprintf("<tr>\n"
 	    "<td>&nbsp;</td>\n"
-	    "<td><a href=/%s/l/%s>Next &raquo;</a></td>\n"
+	    "<td><a href=\"/%s/l/%s?o=%zu\">Next &raquo;</a></td>\n"
 	    "<td>&nbsp;</td>\n"
 	    "<td>&nbsp;</td>\n"
-	    "</tr>\n", rp->name, hex);
+	    "</tr>\n", rp->name, hex, offset);
 }
 
 static void
-render_log_line(const struct repo *rp, const git_commit *ci)
+render_log_line(const struct repo *rp, const struct logitem *it)
 {
 	char hex[GIT_OID_HEXSZ + 1];
-	char title[TITLE_MAX + 1];
-	const git_signature *sig;
+	char title[TITLE_MAX + 2];
 
-	git_oid_tostr(hex, sizeof(hex), git_commit_id(ci));
-	strlcpy(title, git_commit_message(ci), sizeof(title));
+	git_oid_tostr(hex, sizeof(hex), &it->id);
+	strlcpy(title, it->subject, TITLE_MAX + 1);
 	abbrev(title, TITLE_MAX);
 
-
-	puts("<tr>\n<td>");
-	printgt(git_commit_time(ci));
-	printf("</td>\n"
-	    "<td><a href=/%s/c/%s>%.*s</a></td>\n"
-	    "<td>", rp->name, hex, OBJ_ABBREV, hex);
+	bputs("<tr>\n<td>\n");
+	printgt(it->time);
+	bputs("</td>\n<td><a href=/");
+	bputs(rp->name);
+	bputs("/c/");
+	bput(hex, GIT_OID_HEXSZ);
+	bputc('>');
+	bput(hex, OBJ_ABBREV);
+	bputs("</a></td>\n<td>");
 	htmlesc(title);
-	puts("</td>\n<td>");
-	if ((sig = git_commit_author(ci)) != NULL)
-		htmlesc(sig->name);
+	bputs("</td>\n<td>\n");
+	if (it->author != NULL)
+		htmlesc(it->author);
 	else
-		puts("&nbsp;");
-	puts("</td>\n</tr>");
+		bputs("&nbsp;\n");
+	bputs("</td>\n</tr>\n");
 }
 
-static void
-render_log_list(const struct repo *rp, size_t n, const char *rev)
+/* Lists commits from the commit log, which only covers HEAD */
+static size_t
+log_from_graph(const struct repo *rp, const git_oid *start, size_t offset,
+    size_t n)
+{
+	struct graphlog gl;
+	struct logitem it;
+	size_t i;
+
+	graph_log_open(&gl, rp, start);
+	HOLD(&gl, graph_log_close);
+
+	for (i = offset; i < gl.n && i < offset + n; i++) {
+		graph_log_get(&gl, i, &it);
+		render_log_line(rp, &it);
+	}
+	n = gl.n;
+	release(&gl);
+
+	return n;
+}
+
+/* Walks other starting points, skipping offset commits unread */
+static size_t
+log_from_walk(const struct repo *rp, const git_oid *start, size_t offset,
+    size_t n)
 {
 	git_revwalk *w;
-	git_object *obj = NULL;
-	git_commit *ci = NULL;
+	git_commit *ci;
+	const git_signature *sig;
+	struct logitem it;
 	git_oid id;
 	size_t i;
 
-	puts("<div class=log>\n<table>\n"
+	if (git_revwalk_new(&w, rp->handle))
+		geprintf("revwalk new %s:", rp->path);
+	HOLD(w, git_revwalk_free);
+	if (git_revwalk_push(w, start))
+		geprintf("revwalk push %s:", rp->path);
+	git_revwalk_sorting(w, GIT_SORT_TOPOLOGICAL | GIT_SORT_TIME);
+
+	for (i = 0; i < offset + n && !git_revwalk_next(&id, w); i++) {
+		if (i < offset)
+			continue;
+		if (git_commit_lookup(&ci, rp->handle, &id))
+			geprintf("commit lookup %s:", rp->path);
+		HOLD(ci, git_commit_free);
+		timing_count(COUNT_OBJECTS, 1);
+		git_oid_cpy(&it.id, &id);
+		it.time = git_commit_time(ci);
+		it.gen = 0;
+		it.subject = git_commit_message(ci);
+		it.author = (sig = git_commit_author(ci)) ? sig->name : NULL;
+		render_log_line(rp, &it);
+		release(ci);
+	}
+	if (i == offset + n && !git_revwalk_next(&id, w))
+		i++;
+
+	release(w);
+
+	return i;
+}
+
+/*
+ * Lists n commits from start on, or a page of them after offset with a
+ * link to the next one when n is 0.
+ */
+static void
+render_log_list(const struct repo *rp, size_t n, const git_oid *start,
+    size_t offset)
+{
+	git_oid head;
+	size_t total, count;
+
+	bputs("<div class=log>\n<table>\n"
 	    "<tr>\n"
 	    "<th>Date</th>\n"
 	    "<th>Id</th>\n"
 	    "<th>Subject</th>"
 	    "<th>Author</th>"
-	    "</tr>");
+	    "</tr>\n");
 
-	if (git_revwalk_new(&w, rp->handle))
-		geprintf("revwalk new %s:", rp->path);
-	if (rev && strlen(rev) > 0) {
-		if (git_revparse_single(&obj, rp->handle, rev))
-			geprintf("revparse single %s:", rp->path);
-		if (git_revwalk_push(w, git_object_id(obj)))
-			geprintf("revwalk push %s:", rp->path);
-	} else {
-		if (git_revwalk_push_head(w))
-			geprintf("revwalk push head %s:", rp->path);
-	}
+	count = n > 0 ? n : LOG_PER_PAGE;
+	timing_start(TIMER_WALK);
+	if (!head_id(rp, &head) && git_oid_equal(start, &head))
+		total = log_from_graph(rp, start, offset, count);
+	else
+		total = log_from_walk(rp, start, offset, count);
+	timing_stop(TIMER_WALK);
 
-	git_revwalk_sorting(w, GIT_SORT_TIME);
+	if (n == 0 && total > offset + count)
+		render_log_link(rp, start, offset + count);
 
-	for (i = 0; !git_revwalk_next(&id, w); i++) {
-		if (git_commit_lookup(&ci, rp->handle, &id))
-			geprintf("commit lookup %s:", rp->path);
-		if (n > 0 && i >= n) {
-			git_commit_free(ci);
-			break;
-		} else if (i == LOG_PER_PAGE) {
-			render_log_link(rp, ci);
-			git_commit_free(ci);
-			break;
+	bputs("</table>\n</div>\n");
+}
+
+/* Decoded value of a query string parameter, NULL if it is absent */
+static char *
+query(const char *name)
+{
+	const char *qs, *p;
+	char hex[3], *buf;
+	size_t n, i;
+
+	if ((qs = getparam("QUERY_STRING")) == NULL)
+		return NULL;
+
+	n = strlen(name);
+	for (p = qs; *p; p += strcspn(p, "&;"), p += *p != '\0') {
+		if (strncmp(p, name, n) || p[n] != '=')
+			continue;
+		p += n + 1;
+		buf = arena_alloc(strcspn(p, "&;") + 1);
+		for (i = 0; *p && !strchr("&;", *p); p++) {
+			if (*p == '+') {
+				buf[i++] = ' ';
+			} else if (*p == '%' && isxdigit((unsigned char)p[1]) &&
+			    isxdigit((unsigned char)p[2])) {
+				hex[0] = p[1];
+				hex[1] = p[2];
+				hex[2] = '\0';
+				buf[i++] = strtol(hex, NULL, 16);
+				p += 2;
+			} else
+				buf[i++] = *p;
 		}
-		render_log_line(rp, ci);
-		git_commit_free(ci);
+		buf[i] = '\0';
+		return buf;
 	}
+	return NULL;
+}
 
-	git_revwalk_free(w);
-	if (obj)
-		git_object_free(obj);
+/* Numeric value of a query string parameter, 0 if absent */
+static size_t
+query_num(const char *name)
+{
+	const char *v;
 
-	puts("</table>\n</div>");
+	return (v = query(name)) ? strtoul(v, NULL, 10) : 0;
 }
 
 static void
 render_log(const struct repo *rp, const char *rev)
 {
+	git_object *obj = NULL, *peeled;
+	git_oid id;
+	char extra[32];
+	size_t offset;
+
+	timing_route("log");
+
+	if (rev[0] == '\0') {
+		if (head_id(rp, &id))
+			geprintf("repo head %s:", rp->path);
+	} else if (git_revparse_single(&obj, rp->handle, rev)) {
+		render_notfound();
+		return;
+	} else {
+		HOLD(obj, git_object_free);
+		timing_count(COUNT_OBJECTS, 1);
+		/* Only commits have a log, tags are followed to theirs */
+		if (git_object_peel(&peeled, obj, GIT_OBJ_COMMIT)) {
+			render_notfound();
+			goto cleanup;
+		}
+		git_oid_cpy(&id, git_object_id(peeled));
+		git_object_free(peeled);
+	}
+
+	offset = query_num("o");
+	snprintf(extra, sizeof(extra), "o%zu", offset);
+	if (not_modified('l', &id, offset ? extra : NULL, is_full_id(rev)) ||
+	    cached())
+		goto cleanup;
+
 	http_headers("200 Success");
 	render_header(rp->name, "log");
-	printf("<h1><a href=/>Index</a> / <a href=/%s>%s</a> / log</h1>\n",
+	bprintf("<h1><a href=/>Index</a> / <a href=/%s>%s</a> / log</h1>\n",
 	    rp->name, rp->name);
-	render_log_list(rp, 0, rev);
+	render_log_list(rp, 0, &id, offset);
 	render_footer();
+
+cleanup:
+	release(obj);
+}
+
+/* Orders names the way git sorts tree entries, trees ending in '/' */
+static int
+entrycmp(const char *a, int atree, const char *b, int btree)
+{
+	size_t la, lb, n;
+	int ca, cb, c;
+
+	la = strlen(a);
+	lb = strlen(b);
+	n = la < lb ? la : lb;
+	if ((c = memcmp(a, b, n)) != 0)
+		return c;
+	ca = n < la ? (unsigned char)a[n] : atree ? '/' : '\0';
+	cb = n < lb ? (unsigned char)b[n] : btree ? '/' : '\0';
+
+	return ca - cb;
+}
+
+/* Index of the first entry of t sorting after the name after */
+static size_t
+tree_seek(const git_tree *t, const char *after)
+{
+	const git_tree_entry *te;
+	size_t lo, hi, mid;
+	int istree;
+
+	te = git_tree_entry_byname(t, after);
+	istree = te && git_tree_entry_type(te) == GIT_OBJ_TREE;
+
+	for (lo = 0, hi = git_tree_entrycount(t); lo < hi; ) {
+		mid = lo + (hi - lo) / 2;
+		te = git_tree_entry_byindex(t, mid);
+		if (entrycmp(git_tree_entry_name(te),
+		    git_tree_entry_type(te) == GIT_OBJ_TREE, after, istree) > 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
+static void
+render_tree_link(const struct repo *rp, const git_tree *t, const char *base,
+    size_t idx, size_t max, const char *label)
+{
+	bprintf("<a href=\"/%s/t", rp->name);
+	if (base[0] != '\0')
+		bputc('/');
+	urienc(base);
+	bputc('?');
+	if (idx > 0) {
+		bputs("after=");
+		queryenc(git_tree_entry_name(git_tree_entry_byindex(t,
+		    idx - 1)));
+		bputs("&amp;");
+	}
+	bprintf("n=%zu\">%s</a>\n", max, label);
 }
 
+/*
+ * Lists up to max entries of t sorting after the name after, with
+ * links to the neighbouring pages.
+ */
 static void
-render_tree_list(const struct repo *rp, const git_tree *t, const char *base)
+render_tree_list(const struct repo *rp, const git_tree *t, const char *base,
+    const char *after, size_t max)
 {
-	char *tmp, *parent;
+	char *parent;
 	const git_tree_entry *te;
-	git_object *obj;
-	size_t i, n, size;
+	git_odb *odb;
+	git_otype type;
+	size_t i, n, first, end, size;
 	char dec;
 
-	puts("<div class=tree>\n<table>\n"
+	bputs("<div class=tree>\n<table>\n"
 	    "<tr>\n"
 	    "<th>Name</th>\n"
 	    "<th>Size</th>\n"
-	    "</tr>");
+	    "</tr>\n");
 
-	if (!(tmp = strdup(base)))
-		eprintf("strdup:");
-	if (!(parent = dirname(tmp)))
+	if (!(parent = dirname(arena_strdup(base))))
 		eprintf("dirname:");
-	if (!(parent = strdup(parent)))
-		eprintf("strdup:");
-	free(tmp);
+	parent = arena_strdup(parent);
 
 	if (parent[0] == '.' && parent[1] == '\0')
 		parent[0] = '\0';
 
 	if (base[0] != '\0') {
-		printf("<tr>\n<td colspan=2><a href=/%s/t", rp->name);
+		bprintf("<tr>\n<td colspan=2><a href=/%s/t", rp->name);
 		if (strlen(parent))
-			putchar('/');
+			bputc('/');
 		urienc(parent);
-		puts(">..</a>/</td>\n</tr>");
+		bputs(">..</a>/</td>\n</tr>\n");
 	}
 
-	for (i = 0, n = git_tree_entrycount(t); i < n; i++) {
+	/* Sizes come from object headers, blobs are never inflated */
+	if (git_repository_odb(&odb, rp->handle))
+		geprintf("repository odb %s:", rp->path);
+	HOLD(odb, git_odb_free);
+
+	n = git_tree_entrycount(t);
+	first = after ? tree_seek(t, after) : 0;
+	end = n - first > max ? first + max : n;
+
+	for (i = first; i < end; i++) {
 		if ((te = git_tree_entry_byindex(t, i)) == NULL)
 			geprintf("tree entry byindex %s:", rp->path);
-		if (git_tree_entry_to_object(&obj, rp->handle, te))
-			geprintf("tree entry to object %s:", rp->path);
 
 		dec = '\0';
 		size = 0;
 
-		switch (git_object_type(obj)) {
+		switch (git_tree_entry_type(te)) {
 		case GIT_OBJ_TREE:
 			dec = '/';
 			break;
 		case GIT_OBJ_BLOB:
-			size = git_odb_object_size((git_odb_object *)obj);
+			if (git_odb_read_header(&size, &type, odb,
+			    git_tree_entry_id(te)))
+				geprintf("odb read header %s:", rp->path);
 			break;
 		default:
-			git_object_free(obj);
 			continue;
 		}
 
-		printf("<tr>\n<td><a href=/%s/t/", rp->name);
+		bprintf("<tr>\n<td><a href=/%s/t/", rp->name);
 		urienc(base);
 		if (strlen(base))
-		        putchar('/');
+		        bputc('/');
 		urienc(git_tree_entry_name(te));
-		putchar('>');
+		bputc('>');
 		htmlesc(git_tree_entry_name(te));
-		fputs("</a>", stdout);
+		bputs("</a>");
 		if (dec != '\0')
-			putchar(dec);
-		fputs("</td>\n<td class=r>", stdout);
+			bputc(dec);
+		bputs("</td>\n<td class=r>");
 		if (size > 0)
-			printf("%zu", size);
+			bputu(size);
 		else
-			putchar('-');
-		puts("</td>\n</tr>");
-		git_object_free(obj);
+			bputc('-');
+		bputs("</td>\n</tr>\n");
+	}
+
+	if (first > 0 || end < n) {
+		bputs("<tr>\n<td colspan=2>\n");
+		if (first > 0)
+			render_tree_link(rp, t, base,
+			    first > max ? first - max : 0, max,
+			    "&laquo; Previous");
+		if (end < n)
+			render_tree_link(rp, t, base, end, max,
+			    "Next &raquo;");
+		bputs("</td>\n</tr>\n");
 	}
 
-	puts("</table>\n</div>");
+	release(odb);
+
+	bputs("</table>\n</div>\n");
+}
+
+/* Writes the line number anchors of lines 1 to n in BUFSIZ batches */
+static void
+render_blob_lines(size_t n)
+{
+	char buf[BUFSIZ], num[24], *p;
+	size_t i, len = 0, k, v;
+
+	for (i = 1; i <= n; i++) {
+		p = num + sizeof(num);
+		for (v = i; v > 0; v /= 10)
+			*--p = '0' + v % 10;
+		k = num + sizeof(num) - p;
+
+		if (len + 3 * k + 24 > sizeof(buf)) {
+			bput(buf, len);
+			len = 0;
+		}
+		memcpy(buf + len, "<a href=#l", 10);
+		memcpy(buf + len + 10, p, k);
+		memcpy(buf + len + 10 + k, " id=l", 5);
+		memcpy(buf + len + 15 + k, p, k);
+		buf[len + 15 + 2 * k] = '>';
+		memcpy(buf + len + 16 + 2 * k, p, k);
+		memcpy(buf + len + 16 + 3 * k, "</a>\n", 5);
+		len += 21 + 3 * k;
+	}
+	bput(buf, len);
+}
+
+static void
+render_blob_raw(const struct repo *rp, const git_oid *head, const char *path,
+    const char *what)
+{
+	char hex[GIT_OID_HEXSZ + 1];
+
+	git_oid_tostr(hex, sizeof(hex), head);
+	bprintf("<p>%s, see the <a href=/%s/r/%s/", what, rp->name, hex);
+	urienc(path);
+	bputs(">raw file</a></p>\n");
 }
 
 static void
-render_tree_blob(const git_blob *b)
+render_tree_blob(const struct repo *rp, const git_blob *b,
+    const git_oid *head, const char *path)
 {
-	char *nfmt = "<a href=#l%d id=l%d>%d</a>\n";
-	const char *s;
+	const char *s, *p, *end;
 	git_off_t len;
-	off_t i = 0;
-	size_t n = 1;
+	size_t n;
 
 	if (git_blob_is_binary(b)) {
-		puts("<p>Binary file</p>");
+		render_blob_raw(rp, head, path, "Binary file");
 		return;
 	}
 
 	s = git_blob_rawcontent(b);
 	len = git_blob_rawsize(b);
 
-	puts("<table id=blob>\n"
+	/* A trailing newline does not start another line */
+	for (n = 1, p = s, end = s + (len > 0 ? len - 1 : 0);
+	    (p = memchr(p, '\n', end - p)) != NULL; p++)
+		n++;
+
+	bputs("<table id=blob>\n"
 	    "<tr>\n"
 	    "<td class=r>\n"
-	    "<pre>");
-
-	if (n) {
-		printf(nfmt, n, n, n);
-		while (i < len - 1) {
-			if (s[i] == '\n') {
-				n++;
-				printf(nfmt, n, n, n);
-			}
-			i++;
-		}
-	}
-
-	puts("</pre>\n"
+	    "<pre>\n");
+	render_blob_lines(n);
+	bputs("</pre>\n"
 	    "</td>\n"
 	    "<td>\n"
-	    "<pre>");
-	htmlesc(s);
-	puts("</pre>\n"
+	    "<pre>\n");
+	htmlescn(s, len);
+	bputs("</pre>\n"
 	    "</td>\n"
 	    "</tr>\n"
-	    "</table>");
+	    "</table>\n");
 }
 
 static void
-render_tree_lookup(const struct repo *rp, const char *path)
+render_tree_lookup(const struct repo *rp, const char *path, const char *after,
+    size_t max)
 {
-	git_reference *ref;
 	git_commit *ci;
-	git_tree *t;
+	git_tree *t, *sub;
 	git_tree_entry *te = NULL;
-	git_object *obj;
+	git_blob *b;
+	git_odb *odb;
+	git_otype type;
+	git_oid head;
+	size_t size;
 
-	if (git_repository_head(&ref, rp->handle))
+	if (head_id(rp, &head))
 		geprintf("repo head %s:", rp->path);
-	if (git_commit_lookup(&ci, rp->handle, git_reference_target(ref)))
+	if (git_commit_lookup(&ci, rp->handle, &head))
 		geprintf("commit lookup %s:", rp->path);
+	HOLD(ci, git_commit_free);
 	if (git_commit_tree(&t, ci))
 		geprintf("commit tree %s:", rp->path);
+	HOLD(t, git_tree_free);
+	timing_count(COUNT_OBJECTS, 2);
 
-	git_commit_free(ci);
+	release(ci);
 
 	if (path[0] == '\0') {
-		render_tree_list(rp, (git_tree *)t, path);
-		return;
+		render_tree_list(rp, t, path, after, max);
+		goto cleanup;
 	}
 
 	if (git_tree_entry_bypath(&te, t, path)) {
-		puts("<p>Not found</p>");
-		return;
+		bputs("<p>Not found</p>\n");
+		goto cleanup;
 	}
+	HOLD(te, git_tree_entry_free);
 
-	if (git_tree_entry_to_object(&obj, rp->handle, te))
-		geprintf("tree entry to object %s:", rp->path);
-
-	switch (git_object_type(obj)) {
+	switch (git_tree_entry_type(te)) {
 	case GIT_OBJ_TREE:
-		render_tree_list(rp, (git_tree *)obj, path);
-		git_object_free(obj);
+		if (git_tree_lookup(&sub, rp->handle, git_tree_entry_id(te)))
+			geprintf("tree lookup %s:", rp->path);
+		HOLD(sub, git_tree_free);
+		timing_count(COUNT_OBJECTS, 1);
+		render_tree_list(rp, sub, path, after, max);
+		release(sub);
 		break;
 	case GIT_OBJ_BLOB:
-		render_tree_blob((git_blob *)obj);
-		git_object_free(obj);
+		/* Large blobs are not inflated only to be turned down */
+		if (git_repository_odb(&odb, rp->handle))
+			geprintf("repository odb %s:", rp->path);
+		HOLD(odb, git_odb_free);
+		if (git_odb_read_header(&size, &type, odb,
+		    git_tree_entry_id(te)))
+			geprintf("odb read header %s:", rp->path);
+		release(odb);
+		if (size > BLOB_MAX_BYTES) {
+			render_blob_raw(rp, &head, path, "Large file");
+			break;
+		}
+
+		timing_start(TIMER_INFLATE);
+		if (git_blob_lookup(&b, rp->handle, git_tree_entry_id(te)))
+			geprintf("blob lookup %s:", rp->path);
+		timing_stop(TIMER_INFLATE);
+		HOLD(b, git_blob_free);
+		timing_count(COUNT_OBJECTS, 1);
+		timing_count(COUNT_INFLATED, git_blob_rawsize(b));
+		render_tree_blob(rp, b, &head, path);
+		release(b);
 		break;
 	default:
 		break;
 	}
 
-	git_object_free(obj);
-	git_tree_entry_free(te);
+cleanup:
+	release(te);
+	release(t);
 }
 
 static void
 render_tree(const struct repo *rp, const char *path)
 {
-	http_headers("200 Success");
-	render_header(rp->name, "tree");
-	printf("<h1><a href=/>Index</a> / <a href=/%s>%s</a> / ",
+	char *after;
+	git_oid head;
+	size_t max;
+
+	timing_route("tree");
+
+	if (head_id(rp, &head))
+		geprintf("repo head %s:", rp->path);
+	if (not_modified('t', &head, NULL, 0) || cached())
+		return;
+
+	http_headers("200 Success");
+	render_header(rp->name, "tree");
+	bprintf("<h1><a href=/>Index</a> / <a href=/%s>%s</a> / ",
 	    rp->name, rp->name);
 	htmlesc(path);
-	puts("</h1>");
-	render_tree_lookup(rp, path);
+	bputs("</h1>\n");
+	after = query("after");
+	if ((max = query_num("n")) == 0 || max > TREE_PER_PAGE)
+		max = TREE_PER_PAGE;
+	render_tree_lookup(rp, path, after, max);
 	render_footer();
 }
 
 static void
-render_ref_item(git_reference *ref, const struct repo *rp)
+render_ref_item(const struct repo *rp, const struct refitem *it)
 {
-	git_reference *res = NULL;
-	git_object *obj;
-	git_commit *ci;
-	const git_signature *sig;
 	char hex[GIT_OID_HEXSZ + 1];
 
-	if (git_reference_type(ref) == GIT_REF_SYMBOLIC)
-		if (git_reference_resolve(&res, ref))
-			geprintf("ref resolve");
-
-	if (git_reference_peel(&obj, res ? res : ref, GIT_OBJ_ANY))
-		geprintf("ref peel");
-	git_oid_tostr(hex, sizeof(hex), git_object_id(obj));
+	git_oid_tostr(hex, sizeof(hex), &it->id);
 
-	if (git_commit_lookup(&ci, rp->handle, git_object_id(obj)))
-		geprintf("commit lookup");
-	fputs("<tr>\n<td>", stdout);
-	printgt(git_commit_time(ci));
-	printf("</td>\n<td><a href=/%s/c/%s>%.*s</a></td>\n<td>",
+	bputs("<tr>\n<td>");
+	printgt(it->time);
+	bprintf("</td>\n<td><a href=/%s/c/%s>%.*s</a></td>\n<td>",
 	    rp->name, hex, OBJ_ABBREV, hex);
-	htmlesc(git_reference_shorthand(ref));
-	puts("</td>\n<td>");
-	if ((sig = git_commit_author(ci)) != NULL)
-		htmlesc(sig->name);
+	htmlesc(it->name);
+	bputs("</td>\n<td>\n");
+	if (it->author != NULL)
+		htmlesc(it->author);
 	else
-		puts("&nbsp;");
-	puts("</td>\n</tr>");
-
-	git_commit_free(ci);
-	git_object_free(obj);
-	if (res)
-		git_reference_free(res);
+		bputs("&nbsp;\n");
+	bputs("</td>\n</tr>\n");
 }
 
+/*
+ * Renders branches or tags [first, end) out of total. The table holds
+ * the branches first, so tags start after them.
+ */
 static void
-render_refs(const struct repo *rp)
+render_ref_list(const struct repo *rp, const struct reftable *rt, int tags,
+    size_t first, size_t end, size_t total)
 {
-	git_strarray refs;
-	git_reference *ref;
-	size_t i;
-	int nbranch = 0, ntag = 0;
+	struct refitem it;
+	size_t i, base;
 
-	char *th = "<table>\n<tr>\n"
+	if (first >= end)
+		return;
+	base = tags ? rt->nbranches : 0;
+
+	if (tags)
+		bprintf("<h2>Tag%s</h2>\n", total > 1 ? "s" : "");
+	else
+		bprintf("<h2>Branch%s</h2>\n", total > 1 ? "es" : "");
+	bputs("<table>\n<tr>\n"
 	    "<th>Date</th>\n"
 	    "<th>Id</th>\n"
 	    "<th>Name</th>\n"
 	    "<th>Author</th>\n"
-	    "</tr>";
+	    "</tr>\n");
+	for (i = first; i < end; i++) {
+		graph_refs_get(rt, base + i, &it);
+		render_ref_item(rp, &it);
+	}
+	bputs("</table>\n");
+}
 
-	git_reference_list(&refs, rp->handle);
+static size_t
+min(size_t a, size_t b)
+{
+	return a < b ? a : b;
+}
 
-	for (i = 0; i < refs.count; ++i) {
-		git_reference_lookup(&ref, rp->handle, refs.strings[i]);
-		if (git_reference_is_branch(ref))
-			nbranch++;
-		if (git_reference_is_tag(ref))
-			ntag++;
-		git_reference_free(ref);
-	}
+/* Lists a page of the branches followed by the tags, newest first */
+static void
+render_refs(const struct repo *rp)
+{
+	struct reftable rt;
+	char extra[32];
+	git_oid head;
+	size_t offset, nb, total, end;
 
-	if (nbranch) {
-		printf("<h2>Branch%s</h2>\n", nbranch > 1 ? "es" : "");
-		puts(th);
-		for (i = 0; i < refs.count; ++i) {
-			git_reference_lookup(&ref, rp->handle, refs.strings[i]);
-			if (!git_reference_is_branch(ref)) {
-				git_reference_free(ref);
-				continue;
-			}
-			render_ref_item(ref, rp);
-			git_reference_free(ref);
-		}
-		puts("</table>");
-	}
-
-	if (ntag) {
-		printf("<h2>Tag%s</h2>\n", nbranch > 1 ? "s" : "");
-		puts(th);
-		for (i = 0; i < refs.count; ++i) {
-			git_reference_lookup(&ref, rp->handle, refs.strings[i]);
-			if (!git_reference_is_tag(ref)) {
-				git_reference_free(ref);
-				continue;
-			}
-			render_ref_item(ref, rp);
-			git_reference_free(ref);
-		}
-		puts("</table>");
-	}
+	timing_route("refs");
+
+	offset = query_num("o");
+
+	if (head_id(rp, &head))
+		geprintf("repo head %s:", rp->path);
+	timing_start(TIMER_WALK);
+	graph_refs_open(&rt, rp);
+	HOLD(&rt, graph_refs_close);
+	timing_stop(TIMER_WALK);
+	nb = rt.nbranches;
+	total = nb + rt.ntags;
+
+	snprintf(extra, sizeof(extra), "%016" PRIx64 "-o%zu", rt.digest,
+	    offset);
+	if (not_modified('r', &head, extra, 0))
+		goto cleanup;
+
+	http_headers("200 Success");
+	render_header(rp->name, "refs");
+	bprintf("<h1><a href=/>Index</a> / <a href=/%s>%s</a> / refs</h1>\n",
+	    rp->name, rp->name);
+
+	end = min(offset + REFS_PER_PAGE, total);
+	render_ref_list(rp, &rt, 0, min(offset, nb), min(end, nb), nb);
+	render_ref_list(rp, &rt, 1, offset > nb ? offset - nb : 0,
+	    end > nb ? end - nb : 0, rt.ntags);
+
+	if (end < total)
+		bprintf("<p><a href=\"/%s/refs?o=%zu\">Next &raquo;</a></p>\n",
+		    rp->name, offset + REFS_PER_PAGE);
+
+	render_footer();
 
-	git_strarray_free(&refs);
+cleanup:
+	release(&rt);
 }
 
 static void
 render_summary(const struct repo *rp)
 {
-	http_headers("200 Success");
-	render_header(rp->name, "summary");
-	printf("<h1><a href=/>Index</a> / %s</h1>\n", rp->name);
+	char refs[17], hex[GIT_OID_HEXSZ + 1];
+	struct reftable rt;
+	git_oid head;
 
-	printf("<h2><a href=/%s/l>Log</a></h2>\n", rp->name);
-	render_log_list(rp, 3, NULL);
+	timing_route("summary");
 
-	printf("<h2><a href=/%s/t>Tree</a></h2>\n", rp->name);
-	render_tree_lookup(rp, "\0");
+	if (head_id(rp, &head))
+		geprintf("repo head %s:", rp->path);
+	timing_start(TIMER_WALK);
+	graph_refs_open(&rt, rp);
+	HOLD(&rt, graph_refs_close);
+	timing_stop(TIMER_WALK);
+	snprintf(refs, sizeof(refs), "%016" PRIx64, rt.digest);
+	if (not_modified('s', &head, refs, 0))
+		goto cleanup;
 
-	render_refs(rp);
+	http_headers("200 Success");
+	render_header(rp->name, "summary");
+	bprintf("<h1><a href=/>Index</a> / %s</h1>\n", rp->name);
+
+	bprintf("<h2><a href=/%s/l>Log</a></h2>\n", rp->name);
+	render_log_list(rp, 3, &head, 0);
+
+	bprintf("<h2><a href=/%s/t>Tree</a></h2>\n", rp->name);
+	git_oid_tostr(hex, sizeof(hex), &head);
+	bprintf("<p>Download <a href=/%s/a/%s.tar.gz>tar.gz</a> "
+	    "<a href=/%s/a/%s.zip>zip</a></p>\n", rp->name, hex, rp->name,
+	    hex);
+	render_tree_lookup(rp, "\0", NULL, TREE_PER_PAGE);
+
+	/* Only the most recent refs, the rest is on the refs page */
+	render_ref_list(rp, &rt, 0, 0, min(rt.nbranches, REFS_SUMMARY),
+	    rt.nbranches);
+	render_ref_list(rp, &rt, 1, 0, min(rt.ntags, REFS_SUMMARY), rt.ntags);
+	if (rt.nbranches > REFS_SUMMARY || rt.ntags > REFS_SUMMARY)
+		bprintf("<p><a href=/%s/refs>All %zu refs</a></p>\n", rp->name,
+		    rt.nbranches + rt.ntags);
 
 	render_footer();
+
+cleanup:
+	release(&rt);
 }
 
 static void
 render_signature(const char *t1, const char *t2, const git_signature *sig)
 {
-	printf("<tr>\n<td class=b>%s</td>\n<td>", t1);
+	bprintf("<tr>\n<td class=b>%s</td>\n<td>", t1);
 	htmlesc(sig->name);
 	htmlesc(" <");
 	htmlesc(sig->email);
 	htmlesc(">");
-	puts("</td>\n</tr>");
-	printf("<tr>\n<td class=b>%s</td>\n<td>", t2);
+	bputs("</td>\n</tr>\n");
+	bprintf("<tr>\n<td class=b>%s</td>\n<td>", t2);
 	printgt(sig->when.time);
-	puts(" ");
+	bputs(" \n");
 	printgo(sig->when.offset);
-	puts("</td>\n</tr>");
+	bputs("</td>\n</tr>\n");
 }
 
 static void
-render_commit_header(const struct repo *rp, git_commit *ci)
+render_commit_header(const struct repo *rp, git_commit *ci,
+    const git_oid *kids, size_t nkids)
 {
 	const git_signature *s1, *s2;
 	unsigned int i, n;
 	char hex[GIT_OID_HEXSZ + 1];
-	git_revwalk *w;
-	git_oid cur_id;
-	git_oid prev_id;
 	size_t j;
 
 	if ((s1 = git_commit_author(ci)) != NULL)
@@ -651,96 +1240,131 @@ render_commit_header(const struct repo *rp, git_commit *ci)
 		render_signature("Committer", "Commit date", s2);
 
 	if ((n = git_commit_parentcount(ci)) > 0) {
-		printf("<tr>\n<td class=b>Parent%s</td>\n<td>",
+		bprintf("<tr>\n<td class=b>Parent%s</td>\n<td>",
 		    n > 1 ? "s" : "");
 		for (i = 0; i < n; i++) {
 			git_oid_tostr(hex, sizeof(hex),
 			    git_commit_parent_id(ci, i));
-			printf("<a href=/%s/c/%s>%.*s</a> ",
+			bprintf("<a href=/%s/c/%s>%.*s</a> ",
 			    rp->name, hex, OBJ_ABBREV, hex);
 		}
-		puts("</td>\n</tr>");
+		bputs("</td>\n</tr>\n");
 	}
 
-	if (git_revwalk_new(&w, rp->handle))
-		geprintf("revwalk new %s:", rp->path);
-	if (git_revwalk_push_head(w))
-		geprintf("revwalk push head %s:", rp->path);
-	git_revwalk_sorting(w, GIT_SORT_TIME);
-
-	/* Find child for the last LOG_PER_PAGE commits */
-	for (j = 0; j < LOG_PER_PAGE && !git_revwalk_next(&cur_id, w); j++) {
-		if (!git_oid_cmp(&cur_id, git_commit_id(ci)) &&
-		    !git_oid_iszero(&prev_id)) {
-			git_oid_tostr(hex, sizeof(hex), &prev_id);
-			printf("<tr>\n<td class=b>Child</td>\n<td>"
-			    "<a href=/%s/c/%s>%.*s</a></td></tr>",
+	if (nkids > 0) {
+		bprintf("<tr>\n<td class=b>Child%s</td>\n<td>",
+		    nkids > 1 ? "ren" : "");
+		for (j = 0; j < nkids; j++) {
+			git_oid_tostr(hex, sizeof(hex), &kids[j]);
+			bprintf("<a href=/%s/c/%s>%.*s</a> ",
 			    rp->name, hex, OBJ_ABBREV, hex);
 		}
-		prev_id = cur_id;
+		bputs("</td>\n</tr>\n");
 	}
-
-	git_revwalk_free(w);
 }
 
 static void
-render_commit_stats(git_diff *diff)
+render_commit_stats(const struct repo *rp, const char *hex, git_diff *diff,
+    git_patch **patches, const unsigned char *inl, size_t n)
 {
 	const git_diff_delta *delta;
-	git_patch *patch;
-	size_t n, i, add, del, total_add, total_del;
+	size_t i, shown, add, del, total_add, total_del;
 
 	total_add = 0;
 	total_del = 0;
+	shown = n < DIFF_MAX_FILES ? n : DIFF_MAX_FILES;
 
-	for (i = 0, n = git_diff_num_deltas(diff); i < n; i++) {
-		patch = NULL;
-		if (git_patch_from_diff(&patch, diff, i))
-			geprintf("patch from diff");
-
-		delta = git_patch_get_delta(patch);
+	for (i = 0; i < shown; i++) {
+		if (patches[i] != NULL)
+			delta = git_patch_get_delta(patches[i]);
+		else
+			delta = git_diff_get_delta(diff, i);
 
-		printf("<tr>\n<td><a href=#f%zu>", i);
+		if (inl[i])
+			bprintf("<tr>\n<td><a href=#f%zu>", i);
+		else
+			bprintf("<tr>\n<td><a href=/%s/c/%s/f/%zu>",
+			    rp->name, hex, i);
 		htmlesc(delta->old_file.path);
-		fputs("</a>", stdout);
+		bputs("</a>");
 		if (strcmp(delta->old_file.path, delta->new_file.path)) {
-			fputs(" => ", stdout);
+			bputs(" => ");
 			htmlesc(delta->new_file.path);
 		}
 
-		puts("</td>\n");
+		bputs("</td>\n\n");
 
 		if (delta->flags & GIT_DIFF_FLAG_BINARY)
-			printf("<td colspan=2>%ju -> %ju bytes</td>",
+			bprintf("<td colspan=2>%ju -> %ju bytes</td>",
 			    (uintmax_t) delta->old_file.size,
 			    (uintmax_t) delta->new_file.size);
 		else {
 			add = 0;
 			del = 0;
-			if (git_patch_line_stats(NULL, &add, &del, patch))
+			if (patches[i] != NULL &&
+			    git_patch_line_stats(NULL, &add, &del, patches[i]))
 				geprintf("patch line stats");
 
 			total_add += add;
 			total_del += del;
 
-			printf("<td class='a r'>+%zu</td>"
+			bprintf("<td class='a r'>+%zu</td>"
 			    "<td class='d r'>-%zu</td>\n", add, del);
-
-			git_patch_free(patch);
 		}
-		puts("</tr>");
+		bputs("</tr>\n");
+	}
+	/* Files beyond DIFF_MAX_FILES have no patch, only a link */
+	for (; i < n; i++) {
+		delta = git_diff_get_delta(diff, i);
+		bprintf("<tr>\n<td colspan=3><a href=/%s/c/%s/f/%zu>",
+		    rp->name, hex, i);
+		htmlesc(delta->new_file.path);
+		bputs("</a></td>\n</tr>\n");
 	}
-	if (n > 1)
-		printf("<tr>\n<td>%zu files</td>\n<td class='a r'>+%zu</td>\n"
+	if (shown < n)
+		bprintf("<tr>\n<td colspan=3>%zu files, %zu without line "
+		    "counts</td>\n</tr>\n", n, n - shown);
+	else if (n > 1)
+		bprintf("<tr>\n<td>%zu files</td>\n<td class='a r'>+%zu</td>\n"
 		    "<td class='d r'>-%zu</td>\n</tr>\n",
 		    n, total_add, total_del);
 }
 
+/*
+ * Whether a patch is shown inline within the remaining line budget.
+ * Files beyond DIFF_MAX_FILE_BYTES were not loaded and count as binary.
+ */
+static int
+patch_inline(git_patch *patch, size_t *budget)
+{
+	const git_diff_delta *delta;
+	size_t ctx, add, del;
+
+	if (patch == NULL)
+		return 0;
+
+	delta = git_patch_get_delta(patch);
+	if ((delta->flags & GIT_DIFF_FLAG_BINARY) &&
+	    (delta->old_file.size > DIFF_MAX_FILE_BYTES ||
+	    delta->new_file.size > DIFF_MAX_FILE_BYTES))
+		return 0;
+
+	if (git_patch_line_stats(&ctx, &add, &del, patch))
+		geprintf("patch line stats");
+	if (ctx + add + del > *budget) {
+		*budget = 0;
+		return 0;
+	}
+	*budget -= ctx + add + del;
+
+	return 1;
+}
+
 static int
 render_diff_line(const git_diff_delta *delta, const git_diff_hunk *hunk,
     const git_diff_line *line, void *data)
 {
-	size_t i, *nfiles;
+	size_t n, *nfiles;
 	char c;
 
 	nfiles = data;
@@ -769,24 +1393,91 @@ render_diff_line(const git_diff_delta *delta, const git_diff_hunk *hunk,
 	}
 
 	if (c != '\0') {
-		printf("<span class=%c", c);
+		bputs("<span class=");
+		bputc(c);
 		if (c == 'f') {
-			printf(" id=f%zu", *nfiles);
+			bputs(" id=f");
+			bputu(*nfiles);
 			*nfiles = *nfiles + 1;
 		}
-		putchar('>');
+		bputc('>');
 	}
 
 	if (line->origin == GIT_DIFF_LINE_CONTEXT ||
 	    line->origin == GIT_DIFF_LINE_ADDITION ||
 	    line->origin == GIT_DIFF_LINE_DELETION)
-		putchar(line->origin);
+		bputc(line->origin);
 
-	for (i = 0; i < line->content_len - (c == '\0' ? 0 : 1); i++)
-		htmlescchar(line->content[i]);
+	/* Highlighted lines end their span before the newline */
+	n = line->content_len;
+	if (c != '\0' && n > 0)
+		n--;
+	htmlescn(line->content, n);
 
 	if (c != '\0')
-		puts("</span>");
+		bputs("</span>\n");
+
+	return 0;
+}
+
+static int
+commit_diff(git_diff **diff, const struct repo *rp, const git_commit *ci)
+{
+	git_commit *parent = NULL;
+	git_tree *tree, *parent_tree = NULL;
+	git_diff_options opts;
+	git_diff_find_options find_opts;
+
+	if (git_commit_tree(&tree, ci))
+		geprintf("commit tree");
+	HOLD(tree, git_tree_free);
+
+	if (!git_commit_parent(&parent, ci, 0)) {
+		HOLD(parent, git_commit_free);
+		if (git_commit_tree(&parent_tree, parent))
+			geprintf("commit tree");
+		HOLD(parent_tree, git_tree_free);
+	}
+
+	/*
+	 * The commit page and the pages of its files number files alike
+	 * only if their diffs are made the same way.
+	 */
+	git_diff_init_options(&opts, GIT_DIFF_OPTIONS_VERSION);
+	opts.max_size = DIFF_MAX_FILE_BYTES;
+	if (git_diff_tree_to_tree(diff, rp->handle, parent_tree, tree, &opts))
+		geprintf("diff tree to tree");
+	/* Held by the caller, who frees it */
+	HOLD(*diff, git_diff_free);
+	git_diff_find_init_options(&find_opts, GIT_DIFF_FIND_OPTIONS_VERSION);
+	if (git_diff_find_similar(*diff, &find_opts))
+		geprintf("diff find similar");
+
+	release(tree);
+	release(parent_tree);
+	release(parent);
+
+	return 0;
+}
+
+static int
+lookup_commit(git_commit **ci, git_object **obj, const struct repo *rp,
+    const char *rev)
+{
+	int e;
+
+	if (git_revparse_single(obj, rp->handle, rev))
+		return -1;
+	HOLD(*obj, git_object_free);
+
+	e = git_commit_lookup(ci, rp->handle, git_object_id(*obj));
+	if (e == GIT_ENOTFOUND) {
+		release(*obj);
+		return -1;
+	} else if (e)
+		geprintf("commit lookup");
+	HOLD(*ci, git_commit_free);
+	timing_count(COUNT_OBJECTS, 2);
 
 	return 0;
 }
@@ -794,21 +1485,20 @@ render_diff_line(const git_diff_delta *delta, const git_diff_hunk *hunk,
 static void
 render_commit(const struct repo *rp, const char *rev)
 {
-	int e;
 	git_object *obj = NULL;
 	git_commit *ci = NULL;
-	git_commit *parent = NULL;
-	git_tree *tree, *parent_tree;
 	git_diff *diff;
-	git_diff_options opts;
-	git_diff_find_options find_opts;
+	git_patch **patches;
+	unsigned char *inl;
 	const git_oid *id;
-	char hex[GIT_OID_HEXSZ + 1];
-	size_t nfiles;
+	git_oid head, kids[CHILD_MAX];
+	char hex[GIT_OID_HEXSZ + 1], extra[17];
+	uint64_t h;
+	size_t i, n, shown, budget, nfiles, nkids;
 
-	nfiles = 0;
+	timing_route("commit");
 
-	if (git_revparse_single(&obj, rp->handle, rev)) {
+	if (lookup_commit(&ci, &obj, rp, rev)) {
 		render_notfound();
 		return;
 	}
@@ -816,60 +1506,427 @@ render_commit(const struct repo *rp, const char *rev)
 	id = git_object_id(obj);
 	git_oid_tostr(hex, sizeof(hex), id);
 
-	e = git_commit_lookup(&ci, rp->handle, id);
-	if (e == GIT_ENOTFOUND) {
-		render_notfound();
+	/*
+	 * Children are added on top of any commit, the page is validated
+	 * by them and never immutable.
+	 */
+	if (head_id(rp, &head))
+		geprintf("repo head %s:", rp->path);
+	timing_start(TIMER_WALK);
+	nkids = graph_children(rp, &head, id, kids, CHILD_MAX);
+	timing_stop(TIMER_WALK);
+	h = 14695981039346656037ULL;
+	for (i = 0; i < nkids * GIT_OID_RAWSZ; i++)
+		h = (h ^ kids[i / GIT_OID_RAWSZ].id[i % GIT_OID_RAWSZ]) *
+		    1099511628211ULL;
+	snprintf(extra, sizeof(extra), "%016" PRIx64, h);
+	if (not_modified('c', id, extra, 0) || cached()) {
+		release(ci);
+		release(obj);
 		return;
-	} else if (e)
-		geprintf("commit lookup");
+	}
 
 	http_headers("200 Success");
 	render_header(rp->name, "commit");
-	printf("<h1><a href=/>Index</a> / <a href=/%s>%s</a> / "
+	bprintf("<h1><a href=/>Index</a> / <a href=/%s>%s</a> / "
 	    "<a href=/%s/l>log</a> / ", rp->name, rp->name, rp->name);
 	htmlesc(hex);
-	puts("</h1>");
+	bputs("</h1>\n");
 
-	puts("<table>");
-	render_commit_header(rp, ci);
-	puts("</table>");
+	bputs("<table>\n");
+	render_commit_header(rp, ci, kids, nkids);
+	bputs("</table>\n");
 
-	puts("<pre id=msg>");
+	bputs("<pre id=msg>\n");
 	htmlesc(git_commit_message(ci));
-	puts("</pre>");
+	bputs("</pre>\n");
+
+	timing_start(TIMER_DIFF);
+	commit_diff(&diff, rp, ci);
+
+	/*
+	 * Each patch is generated once for both the stats and the diff.
+	 * Only DIFF_MAX_FILES get one and only DIFF_MAX_LINES are shown
+	 * inline, the remaining files link to their own page.
+	 */
+	n = git_diff_num_deltas(diff);
+	shown = n < DIFF_MAX_FILES ? n : DIFF_MAX_FILES;
+	patches = arena_array(shown, sizeof(*patches));
+	inl = arena_array(shown, sizeof(*inl));
+	budget = DIFF_MAX_LINES;
+	for (i = 0; i < shown; i++) {
+		if (git_patch_from_diff(&patches[i], diff, i))
+			geprintf("patch from diff");
+		HOLD(patches[i], git_patch_free);
+		inl[i] = patch_inline(patches[i], &budget);
+	}
+	timing_stop(TIMER_DIFF);
+
+	bputs("<div id=stats>\n<table>\n");
+	render_commit_stats(rp, hex, diff, patches, inl, n);
+	bputs("</table>\n</div>\n");
+
+	bputs("<pre id=diff>\n");
+	for (i = 0; i < shown; i++) {
+		if (inl[i]) {
+			nfiles = i;
+			git_patch_print(patches[i], render_diff_line, &nfiles);
+		} else if (patches[i] != NULL) {
+			bprintf("<span class=f id=f%zu>", i);
+			htmlesc(git_patch_get_delta(patches[i])->new_file.path);
+			bprintf("</span>\n<a href=/%s/c/%s/f/%zu>"
+			    "Show diff</a>\n", rp->name, hex, i);
+		}
+	}
+	bputs("</pre>\n");
 
-	if (git_commit_tree(&tree, ci))
-		geprintf("commit tree");
+	/* Newest first, the way they were held */
+	for (i = shown; i-- > 0; )
+		release(patches[i]);
+	release(diff);
+	release(ci);
+	release(obj);
 
-	if (!git_commit_parent(&parent, ci, 0)) {
-		if (git_commit_tree(&parent_tree, parent))
-			geprintf("commit tree");
+	render_footer();
+}
+
+static void
+render_commit_file(const struct repo *rp, const char *rev, size_t idx)
+{
+	git_object *obj = NULL;
+	git_commit *ci = NULL;
+	git_diff *diff = NULL;
+	git_patch *patch = NULL;
+	char hex[GIT_OID_HEXSZ + 1];
+	size_t nfiles;
+
+	timing_route("file");
+
+	if (lookup_commit(&ci, &obj, rp, rev)) {
+		render_notfound();
+		return;
+	}
+	git_oid_tostr(hex, sizeof(hex), git_object_id(obj));
+
+	if (not_modified('f', git_object_id(obj), NULL, is_full_id(rev)) ||
+	    cached())
+		goto cleanup;
+
+	timing_start(TIMER_DIFF);
+	commit_diff(&diff, rp, ci);
+	if (idx >= git_diff_num_deltas(diff)) {
+		timing_stop(TIMER_DIFF);
+		render_notfound();
+		goto cleanup;
+	}
+	if (git_patch_from_diff(&patch, diff, idx))
+		geprintf("patch from diff");
+	HOLD(patch, git_patch_free);
+	timing_stop(TIMER_DIFF);
+
+	http_headers("200 Success");
+	render_header(rp->name, "commit");
+	bprintf("<h1><a href=/>Index</a> / <a href=/%s>%s</a> / "
+	    "<a href=/%s/l>log</a> / <a href=/%s/c/%s>%.*s</a> / ",
+	    rp->name, rp->name, rp->name, rp->name, hex, OBJ_ABBREV, hex);
+	htmlesc(git_diff_get_delta(diff, idx)->new_file.path);
+	bputs("</h1>\n");
+
+	bputs("<pre id=diff>\n");
+	nfiles = idx;
+	if (patch != NULL)
+		git_patch_print(patch, render_diff_line, &nfiles);
+	bputs("</pre>\n");
+
+	render_footer();
+
+cleanup:
+	release(patch);
+	release(diff);
+	release(ci);
+	release(obj);
+}
+
+static const char *
+raw_type(const char *path, const git_blob *b)
+{
+	static const struct {
+		const char *ext;
+		const char *type;
+	} types[] = {
+		{ ".gif", "image/gif" },
+		{ ".jpeg", "image/jpeg" },
+		{ ".jpg", "image/jpeg" },
+		{ ".pdf", "application/pdf" },
+		{ ".png", "image/png" },
+		{ ".webp", "image/webp" },
+	};
+	const char *ext;
+	size_t i;
+
+	if ((ext = strrchr(path, '.')) != NULL && !strchr(ext, '/'))
+		for (i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+			if (!strcasecmp(ext, types[i].ext))
+				return types[i].type;
+
+	/* Anything else is never served as markup the browser would run */
+	return git_blob_is_binary(b) ? "application/octet-stream" :
+	    "text/plain; charset=UTF-8";
+}
+
+/*
+ * Parses a single byte range of a len byte body into [*first, *last].
+ * Returns 0 to send everything, 1 for the range, -1 if unsatisfiable.
+ */
+static int
+parse_range(const char *range, git_off_t len, git_off_t *first,
+    git_off_t *last)
+{
+	const char *ifr;
+	char *end;
+	long long a, b;
+
+	if (range == NULL || strncmp(range, "bytes=", 6) || strchr(range, ','))
+		return 0;
+	if ((ifr = getparam("HTTP_IF_RANGE")) != NULL && strcmp(ifr, etag))
+		return 0;
+	range += 6;
+
+	errno = 0;
+	if (range[0] == '-') {
+		b = strtoll(range + 1, &end, 10);
+		if (end == range + 1 || *end != '\0' || errno || b < 0)
+			return 0;
+		if (b == 0 || len == 0)
+			return -1;
+		*first = b < len ? len - b : 0;
+		*last = len - 1;
+		return 1;
+	}
+
+	a = strtoll(range, &end, 10);
+	if (end == range || *end != '-' || errno || a < 0)
+		return 0;
+	range = end + 1;
+	if (*range == '\0') {
+		b = len - 1;
 	} else {
-		parent = NULL;
-		parent_tree = NULL;
+		b = strtoll(range, &end, 10);
+		if (*end != '\0' || errno || b < a)
+			return 0;
 	}
+	if (a >= len)
+		return -1;
 
-	git_diff_init_options(&opts, GIT_DIFF_OPTIONS_VERSION);
-	if (git_diff_tree_to_tree(&diff, rp->handle, parent_tree, tree, &opts))
-		geprintf("diff tree to tree");
-	git_diff_find_init_options(&find_opts, GIT_DIFF_FIND_OPTIONS_VERSION);
-	if (git_diff_find_similar(diff, &find_opts))
-		geprintf("diff find similar");
+	*first = a;
+	*last = b < len ? b : len - 1;
+	return 1;
+}
 
-	puts("<div id=stats>\n<table>");
-	render_commit_stats(diff);
-	puts("</table>\n</div>");
+/*
+ * Finds the object named by a rev:path spec given as <rev>/<path>,
+ * where rev may itself contain slashes.
+ */
+static int
+lookup_path(git_object **obj, const struct repo *rp, const char *spec)
+{
+	char *buf, *p;
+	int e = -1;
+
+	buf = arena_strdup(spec);
+	timing_start(TIMER_INFLATE);
+	for (p = buf; e && (p = strchr(p, '/')) != NULL; p++) {
+		*p = ':';
+		e = git_revparse_single(obj, rp->handle, buf);
+		*p = '/';
+	}
+	timing_stop(TIMER_INFLATE);
+	if (!e) {
+		HOLD(*obj, git_object_free);
+		timing_count(COUNT_OBJECTS, 1);
+	}
 
-	puts("<pre id=diff>");
-	git_diff_print(diff, GIT_DIFF_FORMAT_PATCH, render_diff_line, &nfiles);
-	puts("</pre>");
+	return e ? -1 : 0;
+}
 
-	git_diff_free(diff);
-	git_tree_free(tree);
-	git_tree_free(parent_tree);
-	git_commit_free(ci);
+static void
+render_raw(const struct repo *rp, const char *spec)
+{
+	git_object *obj = NULL;
+	const git_blob *b;
+	const char *s, *path;
+	git_off_t len, first, last;
+	int r;
 
-	render_footer();
+	timing_route("raw");
+
+	if (lookup_path(&obj, rp, spec) ||
+	    git_object_type(obj) != GIT_OBJ_BLOB) {
+		release(obj);
+		render_notfound();
+		return;
+	}
+	b = (const git_blob *)obj;
+	path = strchr(spec, '/');
+
+	/* Only a full commit id pins the path to one blob for good */
+	if (not_modified('b', git_object_id(obj), NULL,
+	    strspn(spec, "0123456789abcdefABCDEF") == GIT_OID_HEXSZ &&
+	    spec[GIT_OID_HEXSZ] == '/'))
+		goto cleanup;
+
+	s = git_blob_rawcontent(b);
+	len = git_blob_rawsize(b);
+	timing_count(COUNT_INFLATED, len);
+	first = 0;
+	last = len - 1;
+
+	if ((r = parse_range(getparam("HTTP_RANGE"), len, &first,
+	    &last)) < 0) {
+		http_fields("416 Range Not Satisfiable", "text/plain");
+		hprintf("Content-Range: bytes */%jd\n", (intmax_t)len);
+		goto cleanup;
+	}
+
+	http_fields(r ? "206 Partial Content" : "200 Success",
+	    raw_type(path, b));
+	hprintf("X-Content-Type-Options: nosniff\n"
+	    "Accept-Ranges: bytes\n");
+	if (r)
+		hprintf("Content-Range: bytes %jd-%jd/%jd\n",
+		    (intmax_t)first, (intmax_t)last, (intmax_t)len);
+
+	/* The body is written straight from the object buffer */
+	resp_stream(last - first + 1);
+	bput(s + first, last - first + 1);
+
+cleanup:
+	release(obj);
+}
+
+/* Drops the page cache copy of an archive an error cut short */
+static void
+discard_copy(FILE *fp)
+{
+	fclose(fp);
+	unlink(copytmp);
+}
+
+/*
+ * Streams an archive of the tree of a commit. Archives of full commit
+ * ids never change and are written to the page cache as they go out.
+ */
+static void
+render_archive(const struct repo *rp, const char *spec)
+{
+	static const struct {
+		const char *ext;
+		const char *type;
+		int fmt;
+	} fmts[] = {
+		{ ".tar.gz", "application/gzip", ARCHIVE_TGZ },
+		{ ".zip", "application/zip", ARCHIVE_ZIP },
+	};
+	char prefix[REPO_NAME_MAX + PATH_MAX + 2];
+	char hex[GIT_OID_HEXSZ + 1], *rev = NULL, *p;
+	const char *name;
+	git_object *obj = NULL;
+	git_commit *ci = NULL;
+	git_tree *t = NULL;
+	FILE *copy = NULL;
+	size_t i, n, len;
+	int imm;
+
+	timing_route("archive");
+
+	len = strlen(spec);
+	for (i = 0; i < sizeof(fmts) / sizeof(fmts[0]); i++) {
+		n = strlen(fmts[i].ext);
+		if (len > n && !strcmp(spec + len - n, fmts[i].ext))
+			break;
+	}
+	if (i == sizeof(fmts) / sizeof(fmts[0])) {
+		render_notfound();
+		return;
+	}
+	rev = arena_strndup(spec, len - n);
+
+	if (lookup_commit(&ci, &obj, rp, rev)) {
+		render_notfound();
+		goto cleanup;
+	}
+	imm = is_full_id(rev);
+	git_oid_tostr(hex, sizeof(hex), git_commit_id(ci));
+
+	/* Everything is unpacked under <name>-<rev>/ */
+	name = (name = strrchr(rp->name, '/')) ? name + 1 : rp->name;
+	if ((n = strlen(name)) > 4 && !strcmp(name + n - 4, ".git"))
+		n -= 4;
+	snprintf(prefix, sizeof(prefix) - 1, "%.*s-%s", (int)n, name,
+	    imm ? hex : rev);
+	if (imm)
+		prefix[n + 1 + OBJ_ABBREV] = '\0';
+	for (p = prefix; *p; p++)
+		if (!isalnum((unsigned char)*p) && !strchr("._-", *p))
+			*p = '-';
+	*p++ = '/';
+	*p = '\0';
+
+	if (not_modified('a', git_commit_id(ci), fmts[i].ext + 1, imm))
+		goto cleanup;
+
+	if (imm && PAGE_CACHE_MAX > 0) {
+		set_cachekey();
+		if (cache_get(cachekey))
+			goto cleanup;
+		copy = cache_create(cachekey, copytmp, sizeof(copytmp));
+		HOLD(copy, discard_copy);
+	}
+
+	http_fields("200 Success", fmts[i].type);
+	hprintf("Content-Disposition: attachment; filename=\"%.*s%s\"\n",
+	    (int)strlen(prefix) - 1, prefix, fmts[i].ext);
+	if (copy != NULL) {
+		fwrite(resp_head()->s, 1, resp_head()->len, copy);
+		putc('\n', copy);
+	}
+	resp_stream(-1);
+
+	if (git_commit_tree(&t, ci))
+		geprintf("commit tree %s:", rp->path);
+	HOLD(t, git_tree_free);
+	archive_write(rp->handle, t, prefix, git_commit_time(ci), fmts[i].fmt,
+	    copy);
+
+	if (copy != NULL) {
+		unhold(copy);
+		cache_commit(cachekey, copy, copytmp);
+	}
+
+cleanup:
+	release(t);
+	release(ci);
+	release(obj);
+}
+
+/* Splits a trailing /f/<n> file index off a commit revision */
+static int
+split_file(char *rev, size_t *idx)
+{
+	char *p, *f = NULL, *end;
+
+	for (p = rev; (p = strstr(p, "/f/")) != NULL; p++)
+		f = p;
+	if (f == NULL || !isdigit((unsigned char)f[3]))
+		return 0;
+
+	errno = 0;
+	*idx = strtoul(f + 3, &end, 10);
+	if (*end != '\0' || errno)
+		return 0;
+	*f = '\0';
+
+	return 1;
 }
 
 static int
@@ -882,14 +1939,18 @@ static void
 route_repo(const char *url, struct repo *rp)
 {
 	char *p;
-	size_t n;
+	size_t n, idx;
+	int e;
 
-	p = strdup(url);
+	p = arena_strdup(url);
 	n = strlen(p);
-	if (p[n-1] == '/')
+	if (n > 0 && p[n-1] == '/')
 		p[n-1] = '\0';
 
-	if (parse_repo(rp)) {
+	timing_start(TIMER_OPEN);
+	e = parse_repo(rp);
+	timing_stop(TIMER_OPEN);
+	if (e) {
 		render_notfound();
 		goto cleanup;
 	}
@@ -900,58 +1961,281 @@ route_repo(const char *url, struct repo *rp)
 		render_log(rp, p[2] == '\0' ? "\0" : p + 3);
 	else if (p[1] == 't' && urlsep(p + 2))
 		render_tree(rp, p[2] == '\0' ? "\0" : p + 3);
+	else if (!strcmp(p + 1, "refs"))
+		render_refs(rp);
+	else if (p[1] == 'r' && p[2] == '/')
+		render_raw(rp, p + 3);
+	else if (p[1] == 'a' && p[2] == '/')
+		render_archive(rp, p + 3);
+	else if (p[1] == 'c' && p[2] == '/' && split_file(p + 3, &idx))
+		render_commit_file(rp, p + 3, idx);
 	else if (p[1] == 'c' && p[2] == '/')
 		render_commit(rp, p + 3);
 	else
 		render_notfound();
 
 cleanup:
-	free(p);
-	git_repository_free(rp->handle);
+	close_repo(rp);
 }
 
-int
-main(int argc, char *argv[])
+/*
+ * The HTTP server renders pages in several threads at once. They share
+ * the repository list, holding reposlock for reading, while a rescan or
+ * the index page, which update it, hold it for writing. Each thread
+ * opens repositories with handles of its own, which a rescan bumping
+ * reposgen has it drop. Handles left in the list, like those opened
+ * before workers were forked, go to the first thread asking.
+ */
+static struct repos rsp;
+static pthread_rwlock_t reposlock = PTHREAD_RWLOCK_INITIALIZER;
+static unsigned long reposgen;
+static __thread struct {
+	git_repository **handles;
+	size_t n;
+	unsigned long gen;
+} own;
+
+static void
+rescan_repos(void)
 {
-	char *url;
-	struct repos rsp;
-	size_t i, n;
+	int stale;
 
-	(void) argc;
-	(void) argv;
+	pthread_rwlock_rdlock(&reposlock);
+	stale = repos_stale(&rsp);
+	pthread_rwlock_unlock(&reposlock);
+	if (!stale)
+		return;
 
-	rsp.n = 0;
-	rsp.repos = NULL;
+	pthread_rwlock_wrlock(&reposlock);
+	if (repos_stale(&rsp)) {
+		close_repos(&rsp);
+		repos_scan(&rsp);
+		reposgen++;
+	}
+	pthread_rwlock_unlock(&reposlock);
+}
 
-	git_libgit2_init();
+/* Slot of the calling thread for the handle of the i-th repository */
+static git_repository **
+own_handle(size_t i)
+{
+	git_repository **h;
+	size_t j;
+
+	if (own.gen != reposgen) {
+		for (j = 0; j < own.n; j++)
+			git_repository_free(own.handles[j]);
+		own.n = 0;
+		own.gen = reposgen;
+	}
+	if (own.n < rsp.n) {
+		if (!(h = reallocarray(own.handles, rsp.n, sizeof(*h))))
+			eprintf("reallocarray:");
+		memset(h + own.n, 0, (rsp.n - own.n) * sizeof(*h));
+		own.handles = h;
+		own.n = rsp.n;
+	}
+	if (own.handles[i] == NULL)
+		own.handles[i] = __atomic_exchange_n(&rsp.repos[i].handle,
+		    NULL, __ATOMIC_ACQ_REL);
+	return &own.handles[i];
+}
 
-	url = getenv("PATH_INFO");
+/*
+ * Cleans up after an error cut a request short: what it held is freed,
+ * locks included, and the repository is closed to be opened afresh by
+ * the next request. The client gets a 500 page in place of what was
+ * rendered, if none of it went out yet.
+ */
+static void
+serve_failed(void)
+{
+	catch_errors(NULL);
+	release_all();
+	caching = 0;
+	etag[0] = '\0';
+	immutable = 0;
+	if (curh != NULL) {
+		git_repository_free(cur.handle);
+		*curh = NULL;
+		curh = NULL;
+	}
+	if (resp_abort() == 0)
+		render_error();
+}
+
+/*
+ * Opens the repositories and looks up their head commits ahead of
+ * forking workers, so each of them starts out with the pack indexes
+ * mapped instead of loading them again.
+ */
+static void
+warm_repos(void)
+{
+	git_commit *ci;
+	git_oid id;
+	size_t i;
+
+	for (i = 0; i < rsp.n; i++) {
+		if (git_repository_open_bare(&rsp.repos[i].handle,
+		    rsp.repos[i].path)) {
+			gweprintf("repo open %s:", rsp.repos[i].path);
+			rsp.repos[i].handle = NULL;
+			continue;
+		}
+		if (head_id(&rsp.repos[i], &id) == 0 &&
+		    git_commit_lookup(&ci, rsp.repos[i].handle, &id) == 0)
+			git_commit_free(ci);
+	}
+}
+
+static void
+serve(void)
+{
+	struct repo *rp;
+	const char *ae;
+	char *url;
+	size_t n;
+	jmp_buf jb;
+
+	url = getparam("PATH_INFO");
+	timing_begin(url);
+
+	etag[0] = '\0';
+	immutable = 0;
+
+	if ((ae = getparam("HTTP_ACCEPT_ENCODING")) != NULL) {
+		if (accepts(ae, "gzip"))
+			resp_compress("gzip");
+		else if (accepts(ae, "deflate"))
+			resp_compress("deflate");
+	}
 
 	if (!url || url[0] == '\0' || url[0] != '/') {
 		render_notfound();
-		goto cleanup;
+		return;
 	}
 
-	find_repos(&rsp, SCAN_DIR, 0);
+	if (!strncmp(url, "/_static/", 9)) {
+		render_static(url + 9);
+		return;
+	}
+
+	timing_start(TIMER_SCAN);
+	if (!persist)
+		repos_load(&rsp);
+	else
+		rescan_repos();
+	timing_stop(TIMER_SCAN);
+
+	/* Errors from here on end the request rather than the process */
+	curh = NULL;
+	if (setjmp(jb)) {
+		serve_failed();
+		return;
+	}
+	catch_errors(&jb);
 
 	if (url[1] == '\0') {
+		pthread_rwlock_wrlock(&reposlock);
+		HOLD(&reposlock, pthread_rwlock_unlock);
 		render_index(&rsp);
-		goto cleanup;
+		release(&reposlock);
+		catch_errors(NULL);
+		return;
 	}
 
-	for (i = 0; i < rsp.n; i++) {
-		n = strlen(rsp.repos[i].name);
-		if (!strncmp(rsp.repos[i].name, url + 1, n) &&
-		    urlsep(url + n + 1)) {
-			route_repo(url + n + 1, &rsp.repos[i]);
-			goto cleanup;
+	pthread_rwlock_rdlock(&reposlock);
+	HOLD(&reposlock, pthread_rwlock_unlock);
+	if ((rp = repos_lookup(&rsp, url + 1, &n)) != NULL) {
+		cur = *rp;
+		curh = own_handle(rp - rsp.repos);
+		cur.handle = *curh;
+		route_repo(url + n + 1, &cur);
+		*curh = cur.handle;
+		curh = NULL;
+		cache_flush();
+	} else
+		render_notfound();
+	release(&reposlock);
+	catch_errors(NULL);
+}
+
+/* Serves a request of a persistent server, telling it when to stop */
+static int
+serve_persistent(void)
+{
+	serve();
+	arena_reset();
+	return prefork_retire();
+}
+
+/*
+ * Sets up for serving requests in the long run, in WORKERS processes
+ * forked from this one if there are to be any.
+ */
+static void
+persistent(char *(*get)(const char *))
+{
+	persist = 1;
+	getparam = get;
+	repos_load(&rsp);
+	if (WORKERS > 0) {
+		warm_repos();
+		prefork(WORKERS);
+	}
+}
+
+static void
+usage(void)
+{
+	eprintf("usage: gitoff [-r | -s socket | -l address]\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	char *sock = NULL, *addr = NULL;
+	int c, reindex = 0, fd = STDOUT_FILENO;
+
+	while ((c = getopt(argc, argv, "rs:l:")) != -1) {
+		switch (c) {
+		case 'r':
+			reindex = 1;
+			break;
+		case 's':
+			sock = optarg;
+			break;
+		case 'l':
+			addr = optarg;
+			break;
+		default:
+			usage();
 		}
 	}
-	render_notfound();
+	if (optind != argc || reindex + !!sock + !!addr > 1)
+		usage();
 
-cleanup:
-	if (rsp.repos != NULL)
-		free(rsp.repos);
+	git_libgit2_init();
+
+	if (reindex) {
+		repos_scan(&rsp);
+		parse_repos(&rsp);
+	} else if (sock) {
+		fd = fcgi_listen(sock);
+		persistent(fcgi_getparam);
+		fcgi_serve(fd, serve_persistent);
+	} else if (addr) {
+		fd = http_listen(addr);
+		persistent(http_getparam);
+		http_serve(fd, serve_persistent);
+	} else {
+		resp_begin(resp_fdsink, &fd);
+		serve();
+		resp_end();
+	}
+
+	repos_free(&rsp);
 	git_libgit2_shutdown();
 
 	return 0;
@@ -0,0 +1,921 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "compat.h"
+#include "util.h"
+#include "repos.h"
+#include "graph.h"
+#include "timing.h"
+
+#define GRAPH_DIR CACHE_DIR"/graph"
+#define CHILDREN_MAGIC "gitoffc1"
+#define LOG_MAGIC "gitoffl1"
+#define REFS_MAGIC "gitoffr1"
+#define LOG_NONE UINT32_MAX
+
+/*
+ * The child index is an open addressing hash table of parent to child
+ * edges for every commit reachable from tip, keyed by the leading bytes
+ * of the parent id. Empty slots have an all zero parent.
+ */
+struct children_header {
+	char magic[8];
+	git_oid tip;
+	uint32_t nslots;
+	uint32_t pad;
+};
+
+struct edge {
+	git_oid parent;
+	git_oid child;
+};
+
+struct edges {
+	size_t n;
+	size_t cap;
+	struct edge *e;
+};
+
+/*
+ * The commit log lists every commit reachable from tip in topological
+ * order, newest first, so a page of the log is a slice of the entries.
+ * Subjects and author names follow in a string table, each author name
+ * being stored once and referred to by its index.
+ */
+struct log_header {
+	char magic[8];
+	git_oid tip;
+	uint32_t n;
+	uint32_t nauthors;
+	uint32_t strsize;
+	uint32_t pad[2];
+};
+
+struct log_entry {
+	int64_t time;
+	git_oid id;
+	uint32_t gen;
+	uint32_t author;
+	uint32_t subject;
+};
+
+/*
+ * The ref table holds the branches and then the tags of a repository,
+ * each newest first, with the commit they peel to. It is rebuilt when
+ * the stamp of packed-refs and the directories under refs/ changes.
+ */
+struct refs_header {
+	char magic[8];
+	uint64_t stamp;
+	uint64_t digest;
+	uint32_t nbranches;
+	uint32_t ntags;
+	uint32_t strsize;
+	uint32_t pad;
+};
+
+struct ref_entry {
+	int64_t time;
+	git_oid id;
+	uint32_t name;
+	uint32_t author;
+};
+
+struct strtab {
+	char *s;
+	size_t n;
+	size_t cap;
+};
+
+static void
+graph_path(char *buf, size_t n, const struct repo *rp, const char *ext)
+{
+	uint64_t h = 14695981039346656037ULL;
+	const char *p;
+
+	for (p = rp->path; *p; p++)
+		h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+	snprintf(buf, n, "%s/%016" PRIx64 ".%s", GRAPH_DIR, h, ext);
+}
+
+/* Writes a cache file atomically, buf being n bytes after the header */
+static int
+graph_write(const char *path, const void *hdr, size_t hlen,
+    const void *buf, size_t n)
+{
+	char tmp[PATH_MAX + 8];
+	int fd;
+
+	if (mkdir(GRAPH_DIR, 0755) < 0 && errno != EEXIST) {
+		weprintf("mkdir %s:", GRAPH_DIR);
+		return -1;
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	if ((fd = mkstemp(tmp)) < 0) {
+		weprintf("mkstemp %s:", tmp);
+		return -1;
+	}
+	if (write(fd, hdr, hlen) != (ssize_t)hlen ||
+	    (n > 0 && write(fd, buf, n) != (ssize_t)n)) {
+		weprintf("write %s:", tmp);
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	if (close(fd) < 0 || rename(tmp, path) < 0) {
+		weprintf("rename %s:", tmp);
+		unlink(tmp);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Maps a cache file, returning NULL if it is missing or too short */
+static void *
+graph_map(const char *path, size_t *len, size_t min)
+{
+	struct stat st;
+	void *p;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < min) {
+		close(fd);
+		return NULL;
+	}
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	*len = st.st_size;
+	return p;
+}
+
+/* Frees what p points to, for arrays held while they grow */
+static void
+free_ptr(void *p)
+{
+	free(*(void **)p);
+}
+
+static size_t
+slot(const git_oid *id, size_t mask)
+{
+	return ((size_t)id->id[0] << 24 | (size_t)id->id[1] << 16 |
+	    (size_t)id->id[2] << 8 | id->id[3]) & mask;
+}
+
+static void
+add_edge(struct edges *es, const git_oid *parent, const git_oid *child)
+{
+	if (es->n == es->cap) {
+		es->cap = es->cap ? es->cap * 2 : 1024;
+		if (!(es->e = reallocarray(es->e, es->cap, sizeof(*es->e))))
+			eprintf("reallocarray:");
+	}
+	git_oid_cpy(&es->e[es->n].parent, parent);
+	git_oid_cpy(&es->e[es->n].child, child);
+	es->n++;
+}
+
+/* Adds the edges of every commit reachable from tip but not from base */
+static void
+walk_edges(struct edges *es, const struct repo *rp, const git_oid *tip,
+    const git_oid *base)
+{
+	git_revwalk *w;
+	git_commit *ci;
+	git_oid id;
+	unsigned int i, n;
+
+	if (git_revwalk_new(&w, rp->handle))
+		geprintf("revwalk new %s:", rp->path);
+	HOLD(w, git_revwalk_free);
+	if (git_revwalk_push(w, tip))
+		geprintf("revwalk push %s:", rp->path);
+	if (base && git_revwalk_hide(w, base))
+		geprintf("revwalk hide %s:", rp->path);
+
+	while (!git_revwalk_next(&id, w)) {
+		if (git_commit_lookup(&ci, rp->handle, &id))
+			geprintf("commit lookup %s:", rp->path);
+		HOLD(ci, git_commit_free);
+		timing_count(COUNT_OBJECTS, 1);
+		for (i = 0, n = git_commit_parentcount(ci); i < n; i++)
+			add_edge(es, git_commit_parent_id(ci, i), &id);
+		release(ci);
+	}
+
+	release(w);
+}
+
+/* Builds the child index of tip from its edges, the header leading */
+static struct children_header *
+build_children(const git_oid *tip, const struct edges *es, size_t *len)
+{
+	struct children_header *h;
+	struct edge *slots;
+	size_t i, j, nslots, mask;
+
+	for (nslots = 16; nslots < es->n * 2; nslots <<= 1)
+		;
+	*len = sizeof(*h) + nslots * sizeof(*slots);
+	if (!(h = calloc(1, *len)))
+		eprintf("calloc:");
+	slots = (struct edge *)(h + 1);
+	mask = nslots - 1;
+
+	for (i = 0; i < es->n; i++) {
+		for (j = slot(&es->e[i].parent, mask);
+		    !git_oid_iszero(&slots[j].parent); j = (j + 1) & mask)
+			;
+		slots[j] = es->e[i];
+	}
+
+	memcpy(h->magic, CHILDREN_MAGIC, sizeof(h->magic));
+	git_oid_cpy(&h->tip, tip);
+	h->nslots = nslots;
+
+	return h;
+}
+
+static void
+unmap_children(void *h)
+{
+	munmap(h, sizeof(struct children_header) +
+	    (size_t)((struct children_header *)h)->nslots * sizeof(struct edge));
+}
+
+static const struct children_header *
+map_children(const char *path, size_t *len)
+{
+	const struct children_header *h;
+
+	if (!(h = graph_map(path, len, sizeof(*h))))
+		return NULL;
+	if (memcmp(h->magic, CHILDREN_MAGIC, sizeof(h->magic)) ||
+	    *len != sizeof(*h) + (size_t)h->nslots * sizeof(struct edge)) {
+		munmap((void *)h, *len);
+		return NULL;
+	}
+	return h;
+}
+
+/*
+ * Maps the child index of tip, bringing it up to date first. When the
+ * previous tip is an ancestor only the new commits are walked, otherwise
+ * it is rebuilt. When it cannot be written the index is used from
+ * memory, owned telling so.
+ */
+static const struct children_header *
+open_children(const char *path, const struct repo *rp, const git_oid *tip,
+    size_t *len, int *owned)
+{
+	const struct children_header *h;
+	struct children_header *img;
+	const struct edge *slots;
+	struct edges es = { 0, 0, NULL };
+	git_oid base;
+	size_t i;
+
+	*owned = 0;
+	if ((h = map_children(path, len)) != NULL &&
+	    git_oid_equal(&h->tip, tip))
+		return h;
+
+	HOLD(&es.e, free_ptr);
+	if (h != NULL) {
+		HOLD((void *)h, unmap_children);
+		if (!git_merge_base(&base, rp->handle, &h->tip, tip) &&
+		    git_oid_equal(&base, &h->tip)) {
+			slots = (const struct edge *)(h + 1);
+			for (i = 0; i < h->nslots; i++)
+				if (!git_oid_iszero(&slots[i].parent))
+					add_edge(&es, &slots[i].parent,
+					    &slots[i].child);
+			walk_edges(&es, rp, tip, &base);
+		}
+		release((void *)h);
+	}
+
+	if (es.n == 0)
+		walk_edges(&es, rp, tip, NULL);
+
+	img = build_children(tip, &es, len);
+	release(&es.e);
+
+	if (graph_write(path, img, sizeof(*img), img + 1,
+	    *len - sizeof(*img)) == 0 &&
+	    (h = map_children(path, len)) != NULL) {
+		if (git_oid_equal(&h->tip, tip)) {
+			free(img);
+			return h;
+		}
+		munmap((void *)h, *len);
+	}
+
+	*len = sizeof(*img) + (size_t)img->nslots * sizeof(struct edge);
+	*owned = 1;
+	return img;
+}
+
+size_t
+graph_children(const struct repo *rp, const git_oid *tip, const git_oid *id,
+    git_oid *kids, size_t max)
+{
+	const struct children_header *h;
+	const struct edge *slots;
+	char path[PATH_MAX];
+	size_t i, n = 0, len, mask;
+	int owned;
+
+	graph_path(path, sizeof(path), rp, "children");
+	h = open_children(path, rp, tip, &len, &owned);
+
+	slots = (const struct edge *)(h + 1);
+	mask = h->nslots - 1;
+	for (i = slot(id, mask); !git_oid_iszero(&slots[i].parent);
+	    i = (i + 1) & mask)
+		if (git_oid_equal(&slots[i].parent, id) && n < max)
+			git_oid_cpy(&kids[n++], &slots[i].child);
+
+	if (owned)
+		free((void *)h);
+	else
+		munmap((void *)h, len);
+
+	return n;
+}
+
+static uint32_t
+str_add(struct strtab *st, const char *s, size_t len)
+{
+	uint32_t off;
+	char *p;
+
+	if (st->n + len + 1 > st->cap) {
+		st->cap = (st->n + len + 1) * 2;
+		if (!(p = realloc(st->s, st->cap)))
+			eprintf("realloc:");
+		st->s = p;
+	}
+	off = st->n;
+	memcpy(st->s + off, s, len);
+	st->s[off + len] = '\0';
+	st->n += len + 1;
+
+	return off;
+}
+
+static size_t
+strhash(const char *s)
+{
+	size_t h = 2166136261u;
+
+	for (; *s; s++)
+		h = (h ^ (unsigned char)*s) * 16777619u;
+	return h;
+}
+
+/* Index of an author name in authors, adding it on first sight */
+static uint32_t
+add_author(struct strtab *st, uint32_t *authors, uint32_t *nauthors,
+    uint32_t *slots, size_t mask, const char *name)
+{
+	size_t i;
+
+	for (i = strhash(name) & mask; slots[i]; i = (i + 1) & mask)
+		if (!strcmp(st->s + authors[slots[i] - 1], name))
+			return slots[i] - 1;
+
+	authors[*nauthors] = str_add(st, name, strlen(name));
+	slots[i] = ++*nauthors;
+
+	return *nauthors - 1;
+}
+
+static size_t
+log_len(const struct log_header *h)
+{
+	return sizeof(*h) + (size_t)h->n * sizeof(struct log_entry) +
+	    (size_t)h->nauthors * sizeof(uint32_t) + h->strsize;
+}
+
+static void
+unmap_log(void *h)
+{
+	munmap(h, log_len(h));
+}
+
+/*
+ * Builds the commit log of tip, the header leading. Commits are inflated
+ * from the oldest so the generation of their parents is known by the
+ * time they are. Given the log of an ancestor only the commits it lacks
+ * are walked and go before its entries, as none can be a parent of one;
+ * its string table is kept as it is.
+ */
+static struct log_header *
+build_log(const struct repo *rp, const git_oid *tip,
+    const struct log_header *old, size_t *len)
+{
+	struct log_header *h;
+	struct log_entry *es = NULL;
+	struct strtab st = { NULL, 0, 0 };
+	const git_signature *sig;
+	const git_oid *pid;
+	const uint32_t *oauthors = NULL;
+	git_revwalk *w;
+	git_commit *ci;
+	git_oid id;
+	uint32_t *authors = NULL, *ids = NULL, *names = NULL, nauthors = 0;
+	uint32_t gen;
+	size_t i, j, k, n = 0, nnew, cap = 0, nslots, mask;
+	unsigned int np;
+	char *body;
+
+	HOLD(&es, free_ptr);
+	HOLD(&st.s, free_ptr);
+	HOLD(&authors, free_ptr);
+	HOLD(&ids, free_ptr);
+	HOLD(&names, free_ptr);
+
+	if (git_revwalk_new(&w, rp->handle))
+		geprintf("revwalk new %s:", rp->path);
+	HOLD(w, git_revwalk_free);
+	if (git_revwalk_push(w, tip))
+		geprintf("revwalk push %s:", rp->path);
+	if (old != NULL && git_revwalk_hide(w, &old->tip))
+		geprintf("revwalk hide %s:", rp->path);
+	git_revwalk_sorting(w, GIT_SORT_TOPOLOGICAL | GIT_SORT_TIME);
+
+	while (!git_revwalk_next(&id, w)) {
+		if (n == cap) {
+			cap = cap ? cap * 2 : 1024;
+			if (!(es = reallocarray(es, cap, sizeof(*es))))
+				eprintf("reallocarray:");
+		}
+		memset(&es[n], 0, sizeof(*es));
+		git_oid_cpy(&es[n++].id, &id);
+	}
+	release(w);
+	nnew = n;
+
+	if (old != NULL) {
+		if (!(es = reallocarray(es, n + old->n + 1, sizeof(*es))))
+			eprintf("reallocarray:");
+		memcpy(es + n, old + 1, (size_t)old->n * sizeof(*es));
+		n += old->n;
+		oauthors = (const uint32_t *)((const struct log_entry *)
+		    (old + 1) + old->n);
+		if (!(st.s = malloc(old->strsize + 1)))
+			eprintf("malloc:");
+		memcpy(st.s, oauthors + old->nauthors, old->strsize);
+		st.n = st.cap = old->strsize;
+		nauthors = old->nauthors;
+	}
+
+	for (nslots = 16; nslots < (n + nauthors) * 2; nslots <<= 1)
+		;
+	mask = nslots - 1;
+	if (!(ids = calloc(nslots, sizeof(*ids))) ||
+	    !(names = calloc(nslots, sizeof(*names))))
+		eprintf("calloc:");
+	if (!(authors = reallocarray(NULL, nauthors + nnew + 1,
+	    sizeof(*authors))))
+		eprintf("reallocarray:");
+
+	for (i = 0; i < n; i++) {
+		for (j = slot(&es[i].id, mask); ids[j]; j = (j + 1) & mask)
+			;
+		ids[j] = i + 1;
+	}
+
+	/* Authors of the old log are looked up like the ones added */
+	for (i = 0; i < nauthors; i++) {
+		authors[i] = oauthors[i];
+		if (authors[i] >= st.n)
+			continue;
+		for (j = strhash(st.s + authors[i]) & mask; names[j];
+		    j = (j + 1) & mask)
+			;
+		names[j] = i + 1;
+	}
+
+	for (i = nnew; i-- > 0; ) {
+		if (git_commit_lookup(&ci, rp->handle, &es[i].id))
+			geprintf("commit lookup %s:", rp->path);
+		HOLD(ci, git_commit_free);
+		timing_count(COUNT_OBJECTS, 1);
+
+		es[i].time = git_commit_time(ci);
+		k = strnlen(git_commit_message(ci), GRAPH_SUBJECT_MAX);
+		es[i].subject = str_add(&st, git_commit_message(ci), k);
+		if ((sig = git_commit_author(ci)) != NULL)
+			es[i].author = add_author(&st, authors, &nauthors,
+			    names, mask, sig->name);
+		else
+			es[i].author = LOG_NONE;
+
+		gen = 0;
+		for (k = 0, np = git_commit_parentcount(ci); k < np; k++) {
+			pid = git_commit_parent_id(ci, k);
+			for (j = slot(pid, mask); ids[j]; j = (j + 1) & mask)
+				if (git_oid_equal(&es[ids[j] - 1].id, pid)) {
+					if (es[ids[j] - 1].gen > gen)
+						gen = es[ids[j] - 1].gen;
+					break;
+				}
+		}
+		es[i].gen = gen + 1;
+
+		release(ci);
+	}
+
+	/* Entries, author offsets and strings make up the body */
+	k = n * sizeof(*es);
+	j = nauthors * sizeof(*authors);
+	*len = sizeof(*h) + k + j + st.n;
+	if (!(h = calloc(1, *len)))
+		eprintf("calloc:");
+	memcpy(h->magic, LOG_MAGIC, sizeof(h->magic));
+	git_oid_cpy(&h->tip, tip);
+	h->n = n;
+	h->nauthors = nauthors;
+	h->strsize = st.n;
+
+	body = (char *)(h + 1);
+	memcpy(body, es, k);
+	memcpy(body + k, authors, j);
+	memcpy(body + k + j, st.s, st.n);
+
+	release(&names);
+	release(&ids);
+	release(&authors);
+	release(&st.s);
+	release(&es);
+
+	return h;
+}
+
+static const struct log_header *
+map_log(const char *path, size_t *len)
+{
+	const struct log_header *h;
+
+	if (!(h = graph_map(path, len, sizeof(*h))))
+		return NULL;
+	if (memcmp(h->magic, LOG_MAGIC, sizeof(h->magic)) ||
+	    *len != log_len(h) ||
+	    (h->strsize > 0 && ((const char *)h)[*len - 1] != '\0')) {
+		munmap((void *)h, *len);
+		return NULL;
+	}
+	return h;
+}
+
+/*
+ * Maps the commit log of tip, bringing it up to date first. When the
+ * previous tip is an ancestor the log is extended, otherwise it is
+ * rebuilt. When it cannot be written the log is used from memory.
+ */
+void
+graph_log_open(struct graphlog *gl, const struct repo *rp, const git_oid *tip)
+{
+	struct log_header *img = NULL;
+	const struct log_header *h;
+	char path[PATH_MAX];
+	git_oid base;
+	size_t len;
+
+	graph_path(path, sizeof(path), rp, "log");
+
+	if ((h = map_log(path, &len)) != NULL && !git_oid_equal(&h->tip, tip)) {
+		HOLD((void *)h, unmap_log);
+		if (!git_merge_base(&base, rp->handle, &h->tip, tip) &&
+		    git_oid_equal(&base, &h->tip))
+			img = build_log(rp, tip, h, &len);
+		release((void *)h);
+		h = NULL;
+	}
+	if (h == NULL) {
+		if (img == NULL)
+			img = build_log(rp, tip, NULL, &len);
+		if (graph_write(path, img, sizeof(*img), img + 1,
+		    len - sizeof(*img)) == 0 &&
+		    (h = map_log(path, &len)) != NULL &&
+		    git_oid_equal(&h->tip, tip)) {
+			free(img);
+			img = NULL;
+		} else {
+			if (h != NULL)
+				munmap((void *)h, len);
+			h = img;
+			len = log_len(img);
+		}
+	}
+
+	gl->map = h;
+	gl->len = len;
+	gl->owned = img != NULL;
+	gl->n = h->n;
+}
+
+void
+graph_log_get(const struct graphlog *gl, size_t i, struct logitem *it)
+{
+	const struct log_header *h = gl->map;
+	const struct log_entry *e;
+	const uint32_t *authors;
+	const char *strs;
+
+	e = (const struct log_entry *)(h + 1);
+	authors = (const uint32_t *)(e + h->n);
+	strs = (const char *)(authors + h->nauthors);
+	e += i;
+
+	git_oid_cpy(&it->id, &e->id);
+	it->time = e->time;
+	it->gen = e->gen;
+	it->subject = e->subject < h->strsize ? strs + e->subject : "";
+	if (e->author < h->nauthors && authors[e->author] < h->strsize)
+		it->author = strs + authors[e->author];
+	else
+		it->author = NULL;
+}
+
+void
+graph_log_close(struct graphlog *gl)
+{
+	if (gl->owned)
+		free((void *)gl->map);
+	else
+		munmap((void *)gl->map, gl->len);
+	gl->map = NULL;
+}
+
+static uint64_t
+fnv(uint64_t h, const void *buf, size_t n)
+{
+	const unsigned char *p = buf, *end = p + n;
+
+	for (; p < end; p++)
+		h = (h ^ *p) * 1099511628211ULL;
+	return h;
+}
+
+static uint64_t
+stamp_path(uint64_t h, const char *path)
+{
+	struct stat st;
+	int64_t v[3] = { 0, 0, 0 };
+
+	if (stat(path, &st) == 0) {
+		v[0] = st.st_mtim.tv_sec;
+		v[1] = st.st_mtim.tv_nsec;
+		v[2] = st.st_size;
+	}
+	return fnv(h, v, sizeof(v));
+}
+
+/*
+ * Loose refs are written through a rename in their directory, so the
+ * directories under refs/ change along with any loose ref.
+ */
+static uint64_t
+stamp_dirs(uint64_t h, const char *dir, int depth)
+{
+	char path[PATH_MAX];
+	struct dirent *d;
+	struct stat st;
+	DIR *dp;
+
+	h = stamp_path(h, dir);
+	if (depth == 0 || !(dp = opendir(dir)))
+		return h;
+	while ((d = readdir(dp))) {
+		if (d->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, d->d_name);
+		if (d->d_type == DT_DIR || (d->d_type == DT_UNKNOWN &&
+		    stat(path, &st) == 0 && S_ISDIR(st.st_mode)))
+			h = stamp_dirs(h, path, depth - 1);
+	}
+	closedir(dp);
+
+	return h;
+}
+
+static uint64_t
+refs_stamp(const struct repo *rp)
+{
+	char path[PATH_MAX + 16];
+	uint64_t h = 14695981039346656037ULL;
+
+	snprintf(path, sizeof(path), "%s/packed-refs", rp->path);
+	h = stamp_path(h, path);
+	snprintf(path, sizeof(path), "%s/refs", rp->path);
+
+	return stamp_dirs(h, path, 8);
+}
+
+struct rawref {
+	struct ref_entry e;
+	int tag;
+	const char *name;
+};
+
+static int
+rawrefcmp(const void *va, const void *vb)
+{
+	const struct rawref *a = va, *b = vb;
+
+	if (a->tag != b->tag)
+		return a->tag - b->tag;
+	if (a->e.time != b->e.time)
+		return (a->e.time < b->e.time) - (a->e.time > b->e.time);
+	return strcmp(a->name, b->name);
+}
+
+/*
+ * Builds the ref table in a single pass over the refs, peeling each
+ * branch and tag to its commit. Tags of other objects are left out.
+ */
+static struct refs_header *
+build_refs(const struct repo *rp, uint64_t stamp, size_t *len)
+{
+	struct refs_header *h;
+	struct rawref *rs = NULL;
+	struct ref_entry *es;
+	struct strtab st = { NULL, 0, 0 };
+	git_reference_iterator *it;
+	git_reference *ref;
+	const git_signature *sig;
+	git_object *obj;
+	const char *name;
+	size_t i, n = 0, cap = 0;
+	uint32_t nbranches = 0;
+	int tag;
+
+	HOLD(&rs, free_ptr);
+	HOLD(&st.s, free_ptr);
+
+	if (git_reference_iterator_new(&it, rp->handle))
+		geprintf("reference iterator %s:", rp->path);
+	HOLD(it, git_reference_iterator_free);
+	while (!git_reference_next(&ref, it)) {
+		tag = git_reference_is_tag(ref);
+		if ((!tag && !git_reference_is_branch(ref)) ||
+		    git_reference_peel(&obj, ref, GIT_OBJ_COMMIT)) {
+			git_reference_free(ref);
+			continue;
+		}
+		HOLD(ref, git_reference_free);
+		HOLD(obj, git_object_free);
+		if (n == cap) {
+			cap = cap ? cap * 2 : 64;
+			if (!(rs = reallocarray(rs, cap, sizeof(*rs))))
+				eprintf("reallocarray:");
+		}
+		memset(&rs[n], 0, sizeof(*rs));
+		rs[n].tag = tag;
+		rs[n].e.time = git_commit_time((git_commit *)obj);
+		git_oid_cpy(&rs[n].e.id, git_object_id(obj));
+		name = git_reference_shorthand(ref);
+		rs[n].e.name = str_add(&st, name, strlen(name));
+		if ((sig = git_commit_author((git_commit *)obj)) != NULL)
+			rs[n].e.author = str_add(&st, sig->name,
+			    strlen(sig->name));
+		else
+			rs[n].e.author = LOG_NONE;
+		nbranches += !tag;
+		n++;
+
+		release(obj);
+		release(ref);
+	}
+	release(it);
+
+	for (i = 0; i < n; i++)
+		rs[i].name = st.s + rs[i].e.name;
+	qsort(rs, n, sizeof(*rs), rawrefcmp);
+
+	*len = sizeof(*h) + n * sizeof(*es) + st.n;
+	if (!(h = calloc(1, *len)))
+		eprintf("calloc:");
+	memcpy(h->magic, REFS_MAGIC, sizeof(h->magic));
+	h->stamp = stamp;
+	h->digest = 14695981039346656037ULL;
+	h->nbranches = nbranches;
+	h->ntags = n - nbranches;
+	h->strsize = st.n;
+
+	es = (struct ref_entry *)(h + 1);
+	for (i = 0; i < n; i++) {
+		es[i] = rs[i].e;
+		h->digest = fnv(h->digest, rs[i].name, strlen(rs[i].name) + 1);
+		h->digest = fnv(h->digest, es[i].id.id, GIT_OID_RAWSZ);
+	}
+	memcpy(es + n, st.s, st.n);
+
+	release(&st.s);
+	release(&rs);
+
+	return h;
+}
+
+static const struct refs_header *
+map_refs(const char *path, size_t *len)
+{
+	const struct refs_header *h;
+
+	if (!(h = graph_map(path, len, sizeof(*h))))
+		return NULL;
+	if (memcmp(h->magic, REFS_MAGIC, sizeof(h->magic)) ||
+	    *len != sizeof(*h) + ((size_t)h->nbranches + h->ntags) *
+	    sizeof(struct ref_entry) + h->strsize ||
+	    (h->strsize > 0 && ((const char *)h)[*len - 1] != '\0')) {
+		munmap((void *)h, *len);
+		return NULL;
+	}
+	return h;
+}
+
+/*
+ * Maps the ref table, writing it first if the refs changed since. When
+ * it cannot be written the table is used from memory.
+ */
+void
+graph_refs_open(struct reftable *rt, const struct repo *rp)
+{
+	struct refs_header *img = NULL;
+	const struct refs_header *h;
+	char path[PATH_MAX];
+	uint64_t stamp;
+	size_t len;
+
+	graph_path(path, sizeof(path), rp, "refs");
+	stamp = refs_stamp(rp);
+
+	if ((h = map_refs(path, &len)) != NULL && h->stamp != stamp) {
+		munmap((void *)h, len);
+		h = NULL;
+	}
+	if (h == NULL) {
+		img = build_refs(rp, stamp, &len);
+		if (graph_write(path, img, sizeof(*img), img + 1,
+		    len - sizeof(*img)) == 0 &&
+		    (h = map_refs(path, &len)) != NULL) {
+			free(img);
+			img = NULL;
+		} else
+			h = img;
+	}
+
+	rt->map = h;
+	rt->len = len;
+	rt->owned = img != NULL;
+	rt->nbranches = h->nbranches;
+	rt->ntags = h->ntags;
+	rt->digest = h->digest;
+}
+
+/* Gets ref i, the branches coming before the tags */
+void
+graph_refs_get(const struct reftable *rt, size_t i, struct refitem *it)
+{
+	const struct refs_header *h = rt->map;
+	const struct ref_entry *e;
+	const char *strs;
+
+	e = (const struct ref_entry *)(h + 1);
+	strs = (const char *)(e + h->nbranches + h->ntags);
+	e += i;
+
+	git_oid_cpy(&it->id, &e->id);
+	it->time = e->time;
+	it->name = e->name < h->strsize ? strs + e->name : "";
+	it->author = e->author < h->strsize ? strs + e->author : NULL;
+}
+
+void
+graph_refs_close(struct reftable *rt)
+{
+	if (rt->owned)
+		free((void *)rt->map);
+	else
+		munmap((void *)rt->map, rt->len);
+	rt->map = NULL;
+}
@@ -0,0 +1,44 @@
+/* Bytes of a commit message kept as its subject in the commit log */
+#define GRAPH_SUBJECT_MAX 64
+
+struct graphlog {
+	const void *map;
+	size_t len;
+	int owned;
+	size_t n;
+};
+
+struct logitem {
+	git_oid id;
+	git_time_t time;
+	uint32_t gen;
+	const char *author;
+	const char *subject;
+};
+
+struct reftable {
+	const void *map;
+	size_t len;
+	int owned;
+	size_t nbranches;
+	size_t ntags;
+	uint64_t digest;
+};
+
+struct refitem {
+	git_oid id;
+	git_time_t time;
+	const char *name;
+	const char *author;
+};
+
+size_t graph_children(const struct repo *, const git_oid *, const git_oid *,
+    git_oid *, size_t);
+
+void graph_log_open(struct graphlog *, const struct repo *, const git_oid *);
+void graph_log_get(const struct graphlog *, size_t, struct logitem *);
+void graph_log_close(struct graphlog *);
+
+void graph_refs_open(struct reftable *, const struct repo *);
+void graph_refs_get(const struct reftable *, size_t, struct refitem *);
+void graph_refs_close(struct reftable *);
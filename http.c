@@ -0,0 +1,637 @@
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "compat.h"
+#include "http.h"
+#include "util.h"
+#include "resp.h"
+
+/* Request line and header fields of a request */
+#define HTTP_HEAD_MAX 16384
+#define HTTP_EVENTS 64
+/* How often the event loop looks whether to stop, in milliseconds */
+#define HTTP_TICK 1000
+/* Seconds connections get to send a last request once stopping */
+#define HTTP_GRACE 2
+/* Seconds a connection may wait for a request, or the rest of its head */
+#define HTTP_IDLE 30
+#define HTTP_HEAD_TIMEOUT 10
+/* Pages are rendered with paths and such on the stack */
+#define HTTP_STACK (8 << 20)
+
+/*
+ * A client connection. It is active since it was accepted, answered its
+ * last request or began sending the head of the next one, and waiting
+ * while armed for its next event.
+ */
+struct conn {
+	int fd;
+	int waiting;
+	time_t active;
+	size_t len;
+	struct conn *next;
+	struct conn *prev_open;
+	struct conn *next_open;
+	char buf[HTTP_HEAD_MAX];
+};
+
+struct req {
+	int minor;
+	int keep;
+	int head;
+};
+
+/* Request parameters stored as consecutive name\0value\0 pairs */
+static __thread struct {
+	char *buf;
+	size_t len;
+	size_t cap;
+} params;
+
+int
+http_listen(const char *addr)
+{
+	struct addrinfo hints, *res;
+	char host[256], *h, *port;
+	int fd, r, on = 1;
+
+	if (strlcpy(host, addr, sizeof(host)) >= sizeof(host))
+		eprintf("address too long: %s\n", addr);
+	if (!(port = strrchr(host, ':')))
+		eprintf("address without port: %s\n", addr);
+	*port++ = '\0';
+	h = host;
+	if (h[0] == '[' && port[-2] == ']') {
+		h++;
+		port[-2] = '\0';
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if ((r = getaddrinfo(h[0] ? h : NULL, port, &hints, &res)))
+		eprintf("getaddrinfo %s: %s\n", addr, gai_strerror(r));
+
+	if ((fd = socket(res->ai_family, res->ai_socktype,
+	    res->ai_protocol)) < 0)
+		eprintf("socket:");
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0)
+		eprintf("setsockopt:");
+	if (bind(fd, res->ai_addr, res->ai_addrlen) < 0)
+		eprintf("bind %s:", addr);
+	if (listen(fd, SOMAXCONN) < 0)
+		eprintf("listen %s:", addr);
+	if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0)
+		eprintf("fcntl:");
+	freeaddrinfo(res);
+
+	return fd;
+}
+
+static void
+params_add(const char *s, size_t n)
+{
+	char *p;
+
+	if (params.len + n + 1 > params.cap) {
+		params.cap = (params.len + n + 1) * 2;
+		if (!(p = realloc(params.buf, params.cap)))
+			eprintf("realloc:");
+		params.buf = p;
+	}
+	memcpy(params.buf + params.len, s, n);
+	params.len += n;
+	params.buf[params.len++] = '\0';
+}
+
+char *
+http_getparam(const char *name)
+{
+	char *p, *end;
+
+	for (p = params.buf, end = p + params.len; p < end; ) {
+		if (!strcmp(p, name))
+			return p + strlen(p) + 1;
+		p += strlen(p) + 1;
+		p += strlen(p) + 1;
+	}
+	return NULL;
+}
+
+/* Length of the request head at the start of buf, 0 while incomplete */
+static size_t
+head_len(const char *buf, size_t len)
+{
+	const char *p = buf, *end = buf + len;
+
+	while ((p = memchr(p, '\n', end - p)) != NULL) {
+		p++;
+		if (p < end && p[0] == '\n')
+			return p + 1 - buf;
+		if (end - p >= 2 && p[0] == '\r' && p[1] == '\n')
+			return p + 2 - buf;
+	}
+	return 0;
+}
+
+/* Cuts the next line off the head at *p, dropping its CR */
+static char *
+next_line(char **p)
+{
+	char *s = *p, *q;
+
+	q = strchr(s, '\n');
+	*q = '\0';
+	*p = q + 1;
+	if (q > s && q[-1] == '\r')
+		q[-1] = '\0';
+	return s;
+}
+
+/* Whether the comma separated list holds token, ignoring case */
+static int
+has_token(const char *list, const char *token)
+{
+	size_t n = strlen(token), k;
+
+	for (; *list; list += k + strspn(list + k, ",")) {
+		list += strspn(list, " \t,");
+		k = strcspn(list, ",");
+		if (k >= n && !strncasecmp(list, token, n) &&
+		    strspn(list + n, " \t") == k - n)
+			return 1;
+	}
+	return 0;
+}
+
+static int
+hexval(int c)
+{
+	if (isdigit(c))
+		return c - '0';
+	if (isxdigit(c))
+		return tolower(c) - 'a' + 10;
+	return -1;
+}
+
+/* Decodes the %XX escapes of s in place, refusing NUL bytes */
+static int
+pct_decode(char *s)
+{
+	char *d = s;
+	int hi, lo;
+
+	for (; *s; s++) {
+		if (*s != '%') {
+			*d++ = *s;
+			continue;
+		}
+		if ((hi = hexval(s[1])) < 0 || (lo = hexval(s[2])) < 0 ||
+		    (hi | lo) == 0)
+			return -1;
+		*d++ = hi << 4 | lo;
+		s += 2;
+	}
+	*d = '\0';
+	return 0;
+}
+
+/*
+ * Turns the request head in buf, terminated by a blank line, into the
+ * parameters a CGI request would have: REQUEST_METHOD, PATH_INFO and
+ * QUERY_STRING from the request line and HTTP_ ones for header fields.
+ * Returns the status to refuse the request with, or NULL.
+ */
+static const char *
+parse_request(char *buf, size_t len, struct req *rq)
+{
+	char name[128], root[] = "/", *p = buf, *line, *method, *target;
+	char *version, *query, *v, *e;
+	size_t n, i;
+	int body = 0;
+
+	if (memchr(buf, '\0', len))
+		return "400 Bad Request";
+	/* Cut off the blank line ending the head */
+	buf[len - 1] = '\0';
+	if (buf[len - 2] == '\r')
+		buf[len - 2] = '\0';
+
+	line = method = next_line(&p);
+	if (!(target = strchr(line, ' ')) ||
+	    !(version = strchr(target + 1, ' ')))
+		return "400 Bad Request";
+	*target++ = '\0';
+	*version++ = '\0';
+	if (strncmp(version, "HTTP/", 5))
+		return "400 Bad Request";
+	if (strcmp(version, "HTTP/1.1") && strcmp(version, "HTTP/1.0"))
+		return "505 HTTP Version Not Supported";
+	rq->minor = version[7] - '0';
+	rq->keep = rq->minor > 0;
+	rq->head = !strcmp(method, "HEAD");
+
+	params_add("REQUEST_METHOD", 14);
+	params_add(method, strlen(method));
+	params_add("SERVER_PROTOCOL", 15);
+	params_add(version, strlen(version));
+
+	while (*p) {
+		line = next_line(&p);
+		if (!(v = strchr(line, ':')) || v == line ||
+		    (size_t)(v - line) + 6 > sizeof(name))
+			return "400 Bad Request";
+		*v++ = '\0';
+		v += strspn(v, " \t");
+		for (e = v + strlen(v); e > v && (e[-1] == ' ' ||
+		    e[-1] == '\t'); e--)
+			;
+		*e = '\0';
+
+		if (!strcasecmp(line, "Connection")) {
+			if (has_token(v, "close"))
+				rq->keep = 0;
+			else if (has_token(v, "keep-alive"))
+				rq->keep = 1;
+		} else if (!strcasecmp(line, "Transfer-Encoding") ||
+		    (!strcasecmp(line, "Content-Length") && strcmp(v, "0")))
+			body = 1;
+
+		/* Content-Type becomes HTTP_CONTENT_TYPE */
+		n = strlen(line);
+		memcpy(name, "HTTP_", 5);
+		for (i = 0; i < n; i++)
+			name[5 + i] = line[i] == '-' ? '_' :
+			    toupper((unsigned char)line[i]);
+		params_add(name, 5 + n);
+		params_add(v, e - v);
+	}
+
+	if (strcmp(method, "GET") && !rq->head)
+		return "405 Method Not Allowed";
+	/* Bodies are not read, so the next request could not be found */
+	if (body)
+		return "400 Bad Request";
+
+	/* Absolute targets are only told apart by their scheme */
+	if (!strncasecmp(target, "http://", 7) &&
+	    !(target = strchr(target + 7, '/')))
+		target = root;
+	if (target[0] != '/')
+		return "400 Bad Request";
+	if ((query = strchr(target, '?')) != NULL)
+		*query++ = '\0';
+	if (pct_decode(target) < 0)
+		return "400 Bad Request";
+	params_add("PATH_INFO", 9);
+	params_add(target, strlen(target));
+	params_add("QUERY_STRING", 12);
+	params_add(query ? query : "", query ? strlen(query) : 0);
+
+	return NULL;
+}
+
+/* Refuses a request and has the connection closed */
+static void
+http_error(int fd, const char *status)
+{
+	resp_begin(resp_fdsink, &fd);
+	resp_http(1, 0, 0);
+	hprintf("Content-Type: text/plain\n");
+	hprintf("Status: %s\n", status);
+	if (!strncmp(status, "405", 3))
+		hprintf("Allow: GET, HEAD\n");
+	bprintf("%s\n", status);
+	resp_end();
+}
+
+/*
+ * Answers the requests read from c in order, pipelined ones included,
+ * until no more data is there. Returns -1 once c is to be closed. With
+ * stop set, or once handler asks to stop and sets it, c is closed after
+ * the request.
+ */
+static int
+serve_conn(struct conn *c, int (*handler)(void), int *stop)
+{
+	const char *err;
+	struct req rq;
+	ssize_t r;
+	size_t n;
+
+	for (;;) {
+		/* Clients may send empty lines between requests */
+		for (n = 0; n < c->len && (c->buf[n] == '\r' ||
+		    c->buf[n] == '\n'); n++)
+			;
+		c->len -= n;
+		memmove(c->buf, c->buf + n, c->len);
+
+		if ((n = head_len(c->buf, c->len)) > 0) {
+			params.len = 0;
+			if ((err = parse_request(c->buf, n, &rq)) != NULL) {
+				http_error(c->fd, err);
+				return -1;
+			}
+			resp_begin(resp_fdsink, &c->fd);
+			resp_http(rq.minor, rq.keep && !*stop, rq.head);
+			if (handler())
+				*stop = 1;
+			if (resp_end() < 0 || !rq.keep || *stop)
+				return -1;
+			c->len -= n;
+			memmove(c->buf, c->buf + n, c->len);
+			c->active = time(NULL);
+			continue;
+		}
+
+		if (c->len == sizeof(c->buf)) {
+			http_error(c->fd, "431 Request Header Fields Too Large");
+			return -1;
+		}
+		if ((r = read(c->fd, c->buf + c->len,
+		    sizeof(c->buf) - c->len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN ? 0 : -1;
+		}
+		if (r == 0)
+			return -1;
+		if (c->len == 0)
+			c->active = time(NULL);
+		c->len += r;
+	}
+}
+
+#ifdef __linux__
+
+/*
+ * Connections with data to read, handed from the event loop to the
+ * workers. Each is armed for one event at a time, so only one worker
+ * owns a connection until it is armed again. Armed connections waiting
+ * longer than HTTP_IDLE seconds for a request, or HTTP_HEAD_TIMEOUT for
+ * the rest of its head, are closed by the event loop. Once a handler
+ * asks to stop, no more connections are accepted, those open are closed
+ * after their next request and the server returns when they are gone,
+ * or idle for HTTP_GRACE seconds.
+ */
+static struct {
+	struct conn *head;
+	struct conn **tail;
+	struct conn *open;
+	int conns;
+	int busy;
+	int stopping;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+} queue = { NULL, &queue.head, NULL, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER };
+
+static int epfd;
+static int (*handler)(void);
+
+/* Takes c off the open connections, with the queue locked */
+static void
+conn_unlink(struct conn *c)
+{
+	if (c->prev_open != NULL)
+		c->prev_open->next_open = c->next_open;
+	else
+		queue.open = c->next_open;
+	if (c->next_open != NULL)
+		c->next_open->prev_open = c->prev_open;
+	queue.conns--;
+}
+
+static void
+conn_close(struct conn *c)
+{
+	pthread_mutex_lock(&queue.lock);
+	conn_unlink(c);
+	pthread_mutex_unlock(&queue.lock);
+
+	close(c->fd);
+	free(c);
+}
+
+/*
+ * Arms c for its next event, marking it waiting under the lock so the
+ * event loop cannot take it for stale before it is.
+ */
+static void
+conn_arm(struct conn *c, int op)
+{
+	struct epoll_event ev;
+	int r;
+
+	ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+	ev.data.ptr = c;
+	pthread_mutex_lock(&queue.lock);
+	if ((r = epoll_ctl(epfd, op, c->fd, &ev)) == 0)
+		c->waiting = 1;
+	pthread_mutex_unlock(&queue.lock);
+	if (r < 0) {
+		weprintf("epoll_ctl:");
+		conn_close(c);
+	}
+}
+
+/* Closes the connections waiting too long, dropping them from epfd */
+static void
+close_stale(time_t now)
+{
+	struct conn *c, *next, *stale = NULL;
+
+	pthread_mutex_lock(&queue.lock);
+	for (c = queue.open; c != NULL; c = next) {
+		next = c->next_open;
+		if (c->waiting && now - c->active >= (c->len > 0 ?
+		    HTTP_HEAD_TIMEOUT : HTTP_IDLE)) {
+			conn_unlink(c);
+			c->next = stale;
+			stale = c;
+		}
+	}
+	pthread_mutex_unlock(&queue.lock);
+
+	for (c = stale; c != NULL; c = next) {
+		next = c->next;
+		close(c->fd);
+		free(c);
+	}
+}
+
+static void *
+worker(void *arg)
+{
+	struct conn *c;
+	int stop;
+
+	(void)arg;
+	for (;;) {
+		pthread_mutex_lock(&queue.lock);
+		while (queue.head == NULL)
+			pthread_cond_wait(&queue.ready, &queue.lock);
+		c = queue.head;
+		if (!(queue.head = c->next))
+			queue.tail = &queue.head;
+		stop = queue.stopping;
+		queue.busy++;
+		pthread_mutex_unlock(&queue.lock);
+
+		if (serve_conn(c, handler, &stop) == 0 && !stop)
+			conn_arm(c, EPOLL_CTL_MOD);
+		else
+			conn_close(c);
+
+		pthread_mutex_lock(&queue.lock);
+		queue.busy--;
+		queue.stopping |= stop;
+		pthread_mutex_unlock(&queue.lock);
+	}
+	return NULL;
+}
+
+static void
+accept_conns(int lfd)
+{
+	struct conn *c;
+	int fd, on = 1;
+
+	for (;;) {
+		if ((fd = accept(lfd, NULL, NULL)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN)
+				weprintf("accept:");
+			return;
+		}
+		/* Responses go out whole, so there is nothing to coalesce */
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0 ||
+		    !(c = malloc(sizeof(*c)))) {
+			weprintf("accept:");
+			close(fd);
+			continue;
+		}
+		c->fd = fd;
+		c->waiting = 0;
+		c->active = time(NULL);
+		c->len = 0;
+		pthread_mutex_lock(&queue.lock);
+		c->prev_open = NULL;
+		if ((c->next_open = queue.open) != NULL)
+			queue.open->prev_open = c;
+		queue.open = c;
+		queue.conns++;
+		pthread_mutex_unlock(&queue.lock);
+		conn_arm(c, EPOLL_CTL_ADD);
+	}
+}
+
+/*
+ * Answers requests on connections accepted from lfd with HTTP_JOBS
+ * threads, until h returns nonzero and the requests underway are done.
+ */
+void
+http_serve(int lfd, int (*h)(void))
+{
+	struct epoll_event ev, evs[HTTP_EVENTS];
+	pthread_attr_t attr;
+	pthread_t tid;
+	struct conn *c;
+	time_t since = 0, swept = 0, now;
+	int i, n, stop, idle, done;
+
+	signal(SIGPIPE, SIG_IGN);
+	handler = h;
+
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		eprintf("epoll_create1:");
+	/* Workers sharing lfd are not all woken for one connection */
+#ifdef EPOLLEXCLUSIVE
+	ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+#else
+	ev.events = EPOLLIN;
+#endif
+	ev.data.ptr = NULL;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev) < 0)
+		eprintf("epoll_ctl:");
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, HTTP_STACK);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (i = 0; i < HTTP_JOBS; i++)
+		if ((errno = pthread_create(&tid, &attr, worker, NULL)))
+			eprintf("pthread_create:");
+	pthread_attr_destroy(&attr);
+
+	for (;;) {
+		pthread_mutex_lock(&queue.lock);
+		stop = queue.stopping;
+		idle = queue.busy == 0 && queue.head == NULL;
+		done = queue.conns == 0;
+		pthread_mutex_unlock(&queue.lock);
+		if (stop && since == 0) {
+			epoll_ctl(epfd, EPOLL_CTL_DEL, lfd, NULL);
+			since = time(NULL);
+		}
+		if (stop && (done || (idle && time(NULL) - since >= HTTP_GRACE)))
+			break;
+
+		if ((n = epoll_wait(epfd, evs, HTTP_EVENTS, HTTP_TICK)) < 0) {
+			if (errno == EINTR)
+				continue;
+			eprintf("epoll_wait:");
+		}
+		for (i = 0; i < n; i++) {
+			if ((c = evs[i].data.ptr) == NULL) {
+				accept_conns(lfd);
+				continue;
+			}
+			pthread_mutex_lock(&queue.lock);
+			c->waiting = 0;
+			c->next = NULL;
+			*queue.tail = c;
+			queue.tail = &c->next;
+			pthread_cond_signal(&queue.ready);
+			pthread_mutex_unlock(&queue.lock);
+		}
+
+		/* After the events, so none is for a connection closed here */
+		if ((now = time(NULL)) != swept) {
+			close_stale(now);
+			swept = now;
+		}
+	}
+	close(epfd);
+}
+
+#else
+
+void
+http_serve(int lfd, int (*h)(void))
+{
+	(void)lfd;
+	(void)h;
+	eprintf("http: needs epoll, serve FastCGI with -s instead\n");
+}
+
+#endif
@@ -0,0 +1,3 @@
+int http_listen(const char *);
+void http_serve(int, int (*)(void));
+char *http_getparam(const char *);
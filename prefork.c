@@ -0,0 +1,139 @@
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "prefork.h"
+
+struct worker {
+	pid_t pid;
+	time_t started;
+};
+
+static int isworker;
+static unsigned long served;
+static volatile sig_atomic_t quit;
+
+static void
+onquit(int sig)
+{
+	(void)sig;
+	quit = 1;
+}
+
+/* Forks a worker into w, returning 1 in the worker itself */
+static int
+spawn(struct worker *w)
+{
+	pid_t pid;
+
+	if ((pid = fork()) < 0) {
+		weprintf("fork:");
+		return 0;
+	}
+	if (pid == 0) {
+		signal(SIGTERM, SIG_DFL);
+		signal(SIGINT, SIG_DFL);
+		isworker = 1;
+		return 1;
+	}
+	w->pid = pid;
+	w->started = time(NULL);
+	return 0;
+}
+
+/*
+ * Forks n workers and returns in each of them, while the calling process
+ * stays behind as their supervisor. Workers that exit, whether retired
+ * or crashed, are replaced. SIGTERM or SIGINT stop the workers and the
+ * supervisor. Everything opened before is shared by the workers, file
+ * maps like pack indexes included. With n of 0 it returns right away.
+ */
+void
+prefork(int n)
+{
+	struct sigaction sa;
+	struct worker *ws;
+	int i, status, delay = 0;
+	pid_t pid;
+
+	if (n <= 0)
+		return;
+	if (!(ws = calloc(n, sizeof(*ws))))
+		eprintf("calloc:");
+
+	/* Without SA_RESTART, so waiting is interrupted */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = onquit;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+
+	for (;;) {
+		if (quit) {
+			for (i = 0; i < n; i++)
+				if (ws[i].pid != 0)
+					kill(ws[i].pid, SIGTERM);
+			while (wait(NULL) > 0 || errno == EINTR)
+				;
+			exit(0);
+		}
+
+		/* Workers crashing right away are not replaced in a hurry */
+		if (delay)
+			sleep(1);
+		for (i = 0; i < n; i++)
+			if (ws[i].pid == 0 && spawn(&ws[i])) {
+				free(ws);
+				return;
+			}
+
+		if ((pid = waitpid(-1, &status, 0)) < 0) {
+			if (errno == ECHILD)
+				delay = 1;
+			else if (errno != EINTR)
+				eprintf("waitpid:");
+			continue;
+		}
+		for (i = 0; i < n && ws[i].pid != pid; i++)
+			;
+		if (i == n)
+			continue;
+		ws[i].pid = 0;
+
+		delay = 0;
+		if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+			continue;
+		if (WIFSIGNALED(status))
+			weprintf("worker %d: killed by signal %d\n", pid,
+			    WTERMSIG(status));
+		else
+			weprintf("worker %d: exit status %d\n", pid,
+			    WEXITSTATUS(status));
+		delay = time(NULL) - ws[i].started < 1;
+	}
+}
+
+/*
+ * Counts a request served by a worker, telling whether it has served
+ * WORKER_REQUESTS of them or grown beyond WORKER_RSS_MAX kilobytes and
+ * is to retire once the response is out.
+ */
+int
+prefork_retire(void)
+{
+	struct rusage ru;
+
+	if (!isworker)
+		return 0;
+	if (__atomic_add_fetch(&served, 1, __ATOMIC_RELAXED) >=
+	    WORKER_REQUESTS)
+		return 1;
+	return getrusage(RUSAGE_SELF, &ru) == 0 &&
+	    ru.ru_maxrss > WORKER_RSS_MAX;
+}
@@ -0,0 +1,2 @@
+void prefork(int);
+int prefork_retire(void);
@@ -0,0 +1,411 @@
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <dirent.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "compat.h"
+#include "util.h"
+#include "repos.h"
+
+#define INDEX_FILE CACHE_DIR"/index"
+#define INDEX_MAGIC "gitoff-index 1\n"
+
+#define TRIE_ROOT 0
+#define TRIE_NONE SIZE_MAX
+
+static int
+has_file(const char *base, const char *file, int isdir)
+{
+	char buf[PATH_MAX];
+	struct stat st;
+
+	snprintf(buf, sizeof(buf), "%s/%s", base, file);
+	if (stat(buf, &st) < 0) {
+		if (errno != ENOENT)
+			eprintf("stat %s:", buf);
+		return 0;
+	}
+	return isdir ? S_ISDIR(st.st_mode) : S_ISREG(st.st_mode);
+}
+
+static time_t
+file_mtime(const char *base, const char *file)
+{
+	char buf[PATH_MAX];
+	struct stat st;
+
+	snprintf(buf, sizeof(buf), "%s/%s", base, file);
+	if (stat(buf, &st) < 0)
+		return 0;
+	return st.st_mtime;
+}
+
+static int
+valid_git_dir(const char *dir)
+{
+	return has_file(dir, "objects", 1) &&
+	    has_file(dir, "HEAD", 0) &&
+	    has_file(dir, "refs", 1);
+}
+
+static void
+set_repo_name(const struct repo *rp) {
+	const char *p;
+
+	if (strncmp(rp->path, SCAN_DIR"/", strlen(SCAN_DIR"/")) != 0)
+		eprintf("repo path not subdir of SCAN_DIR\n");
+
+	p = rp->path + strlen(SCAN_DIR"/");
+	strlcpy((char *)rp->name, p, sizeof(rp->name));
+}
+
+static struct repo *
+add_repo(struct repos *rsp, const char *path)
+{
+	struct repo *rp;
+
+	rsp->repos = reallocarray(rsp->repos, ++rsp->n, sizeof(struct repo));
+	if (rsp->repos == NULL)
+		eprintf("reallocarray:");
+	rp = &rsp->repos[rsp->n - 1];
+	strlcpy(rp->path, path, PATH_MAX);
+	set_repo_name(rp);
+	rp->age = 0;
+	rp->stamp = 0;
+	rp->handle = NULL;
+
+	return rp;
+}
+
+static void
+add_dir(struct repos *rsp, const char *path, time_t mtime)
+{
+	struct repodir *dp;
+
+	rsp->dirs = reallocarray(rsp->dirs, ++rsp->ndirs,
+	    sizeof(struct repodir));
+	if (rsp->dirs == NULL)
+		eprintf("reallocarray:");
+	dp = &rsp->dirs[rsp->ndirs - 1];
+	strlcpy(dp->path, path, PATH_MAX);
+	dp->mtime = mtime;
+}
+
+static void
+find_repos(struct repos *rsp, const char *dir, int depth)
+{
+	DIR *dp;
+	struct dirent *d;
+	char buf[PATH_MAX];
+
+	if (depth >= 3)
+		return;
+	depth++;
+
+	if (valid_git_dir(dir)) {
+		add_repo(rsp, dir);
+		return;
+	}
+
+	/* Adding or removing a repository changes its parent's mtime */
+	add_dir(rsp, dir, file_mtime(dir, "."));
+
+	if (!(dp = opendir(dir)))
+		eprintf("opendir %s:", dir);
+
+	while ((d = readdir(dp))) {
+		if (strcmp(d->d_name, ".") == 0 ||
+		    strcmp(d->d_name, "..") == 0)
+			continue;
+
+		snprintf(buf, sizeof(buf), "%s/%s", dir, d->d_name);
+		if (has_file(dir, d->d_name, 1))
+			find_repos(rsp, buf, depth);
+	}
+
+	closedir(dp);
+}
+
+/* Changes whenever HEAD or the branch it points to moves */
+time_t
+repo_stamp(const struct repo *rp)
+{
+	time_t t, max;
+
+	max = file_mtime(rp->path, "HEAD");
+	if ((t = file_mtime(rp->path, "refs/heads")) > max)
+		max = t;
+	if ((t = file_mtime(rp->path, "packed-refs")) > max)
+		max = t;
+
+	return max;
+}
+
+int
+repos_stale(const struct repos *rsp)
+{
+	size_t i;
+
+	if (rsp->ndirs == 0)
+		return 1;
+	for (i = 0; i < rsp->ndirs; i++)
+		if (file_mtime(rsp->dirs[i].path, ".") != rsp->dirs[i].mtime)
+			return 1;
+	return 0;
+}
+
+static size_t
+trie_hash(size_t parent, const char *seg, size_t len)
+{
+	size_t i, h = 2166136261u ^ parent;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ (unsigned char)seg[i]) * 16777619u;
+	return h;
+}
+
+static size_t
+trie_child(const struct trie *t, size_t parent, const char *seg, size_t len)
+{
+	const struct trienode *np;
+	size_t i;
+
+	for (i = trie_hash(parent, seg, len) & t->mask; t->slots[i];
+	    i = (i + 1) & t->mask) {
+		np = &t->nodes[t->slots[i] - 1];
+		if (np->parent == parent && np->len == len &&
+		    !memcmp(np->seg, seg, len))
+			return t->slots[i] - 1;
+	}
+	return TRIE_NONE;
+}
+
+static size_t
+trie_add(struct trie *t, size_t parent, const char *seg, size_t len)
+{
+	struct trienode *np;
+	size_t i, n;
+
+	if ((n = trie_child(t, parent, seg, len)) != TRIE_NONE)
+		return n;
+
+	n = t->n++;
+	np = &t->nodes[n];
+	np->parent = parent;
+	np->seg = seg;
+	np->len = len;
+	np->repo = TRIE_NONE;
+
+	for (i = trie_hash(parent, seg, len) & t->mask; t->slots[i];
+	    i = (i + 1) & t->mask)
+		;
+	t->slots[i] = n + 1;
+
+	return n;
+}
+
+static void
+trie_build(struct repos *rsp)
+{
+	struct trie *t = &rsp->trie;
+	const char *p, *s;
+	size_t i, nseg, node;
+
+	for (i = 0, nseg = 1; i < rsp->n; i++)
+		for (p = rsp->repos[i].name, nseg++; *p; p++)
+			if (*p == '/')
+				nseg++;
+
+	for (t->mask = 1; t->mask < nseg * 2; t->mask <<= 1)
+		;
+	if (!(t->nodes = reallocarray(NULL, nseg, sizeof(*t->nodes))))
+		eprintf("reallocarray:");
+	if (!(t->slots = calloc(t->mask, sizeof(*t->slots))))
+		eprintf("calloc:");
+	t->mask--;
+
+	t->n = 1;
+	t->nodes[TRIE_ROOT].parent = TRIE_NONE;
+	t->nodes[TRIE_ROOT].seg = "";
+	t->nodes[TRIE_ROOT].len = 0;
+	t->nodes[TRIE_ROOT].repo = TRIE_NONE;
+
+	for (i = 0; i < rsp->n; i++) {
+		node = TRIE_ROOT;
+		for (s = p = rsp->repos[i].name; ; p++) {
+			if (*p != '/' && *p != '\0')
+				continue;
+			node = trie_add(t, node, s, p - s);
+			if (*p == '\0')
+				break;
+			s = p + 1;
+		}
+		if (t->nodes[node].repo == TRIE_NONE)
+			t->nodes[node].repo = i;
+	}
+}
+
+/* Longest repository name that is a path prefix of url */
+struct repo *
+repos_lookup(const struct repos *rsp, const char *url, size_t *len)
+{
+	const struct trie *t = &rsp->trie;
+	const char *s, *p;
+	size_t node, best = TRIE_NONE;
+
+	if (t->nodes == NULL)
+		return NULL;
+
+	for (node = TRIE_ROOT, s = p = url; ; p++) {
+		if (*p != '/' && *p != '\0')
+			continue;
+		if ((node = trie_child(t, node, s, p - s)) == TRIE_NONE)
+			break;
+		if (t->nodes[node].repo != TRIE_NONE) {
+			best = t->nodes[node].repo;
+			*len = p - url;
+		}
+		if (*p == '\0')
+			break;
+		s = p + 1;
+	}
+
+	return best == TRIE_NONE ? NULL : &rsp->repos[best];
+}
+
+void
+repos_free(struct repos *rsp)
+{
+	free(rsp->repos);
+	free(rsp->dirs);
+	free(rsp->trie.nodes);
+	free(rsp->trie.slots);
+	memset(rsp, 0, sizeof(*rsp));
+}
+
+void
+repos_save(const struct repos *rsp)
+{
+	char tmp[PATH_MAX];
+	FILE *fp;
+	size_t i;
+	int fd;
+
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", INDEX_FILE);
+	if ((fd = mkstemp(tmp)) < 0) {
+		weprintf("mkstemp %s:", tmp);
+		return;
+	}
+	if (!(fp = fdopen(fd, "w"))) {
+		weprintf("fdopen %s:", tmp);
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+
+	fputs(INDEX_MAGIC, fp);
+	for (i = 0; i < rsp->ndirs; i++)
+		fprintf(fp, "d %lld %s\n", (long long)rsp->dirs[i].mtime,
+		    rsp->dirs[i].path);
+	for (i = 0; i < rsp->n; i++)
+		fprintf(fp, "r %lld %lld %s\n",
+		    (long long)rsp->repos[i].stamp,
+		    (long long)rsp->repos[i].age,
+		    rsp->repos[i].path);
+
+	if (fclose(fp) == EOF) {
+		weprintf("fclose %s:", tmp);
+		unlink(tmp);
+		return;
+	}
+	if (rename(tmp, INDEX_FILE) < 0) {
+		weprintf("rename %s:", tmp);
+		unlink(tmp);
+	}
+}
+
+/* Whether path is dir or below it, as paths in an index must be */
+static int
+under_scan_dir(const char *path, int isdir)
+{
+	size_t n = strlen(SCAN_DIR);
+
+	if (strlen(path) >= PATH_MAX || strncmp(path, SCAN_DIR, n) != 0)
+		return 0;
+	if (isdir && path[n] == '\0')
+		return 1;
+	return path[n] == '/' && path[n + 1] != '\0';
+}
+
+static int
+read_index(struct repos *rsp)
+{
+	char buf[PATH_MAX + 64], *p, *end;
+	long long stamp, age;
+	struct repo *rp;
+	FILE *fp;
+	size_t n;
+
+	if (!(fp = fopen(INDEX_FILE, "r"))) {
+		if (errno != ENOENT)
+			weprintf("fopen %s:", INDEX_FILE);
+		return -1;
+	}
+	if (!fgets(buf, sizeof(buf), fp) || strcmp(buf, INDEX_MAGIC))
+		goto bad;
+
+	while (fgets(buf, sizeof(buf), fp)) {
+		if ((n = strlen(buf)) == 0 || buf[n - 1] != '\n')
+			goto bad;
+		buf[n - 1] = '\0';
+
+		stamp = strtoll(buf + 2, &end, 10);
+		if (buf[0] == 'd' && *end == ' ') {
+			if (!under_scan_dir(end + 1, 1))
+				goto bad;
+			add_dir(rsp, end + 1, stamp);
+			continue;
+		}
+		if (buf[0] != 'r' || *end != ' ')
+			goto bad;
+		age = strtoll(end + 1, &p, 10);
+		if (*p != ' ' || !under_scan_dir(p + 1, 0))
+			goto bad;
+		rp = add_repo(rsp, p + 1);
+		rp->stamp = stamp;
+		rp->age = age;
+	}
+	if (ferror(fp))
+		goto bad;
+
+	fclose(fp);
+	return 0;
+
+bad:
+	weprintf("%s: malformed index\n", INDEX_FILE);
+	fclose(fp);
+	repos_free(rsp);
+	return -1;
+}
+
+void
+repos_scan(struct repos *rsp)
+{
+	repos_free(rsp);
+	find_repos(rsp, SCAN_DIR, 0);
+	repos_save(rsp);
+	trie_build(rsp);
+}
+
+void
+repos_load(struct repos *rsp)
+{
+	if (read_index(rsp) < 0 || repos_stale(rsp))
+		repos_scan(rsp);
+	else
+		trie_build(rsp);
+}
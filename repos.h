@@ -0,0 +1,45 @@
+#define REPO_NAME_MAX 64
+
+struct repo {
+	char path[PATH_MAX];
+	char name[REPO_NAME_MAX];
+	git_time_t age;
+	time_t stamp;
+	git_repository *handle;
+};
+
+struct repodir {
+	char path[PATH_MAX];
+	time_t mtime;
+};
+
+/* Path segment trie over repository names, edges kept in one hash */
+struct trienode {
+	size_t parent;
+	const char *seg;
+	size_t len;
+	size_t repo;
+};
+
+struct trie {
+	size_t n;
+	struct trienode *nodes;
+	size_t mask;
+	size_t *slots;
+};
+
+struct repos {
+	size_t n;
+	struct repo *repos;
+	size_t ndirs;
+	struct repodir *dirs;
+	struct trie trie;
+};
+
+void repos_load(struct repos *);
+void repos_scan(struct repos *);
+int repos_stale(const struct repos *);
+void repos_save(const struct repos *);
+void repos_free(struct repos *);
+struct repo *repos_lookup(const struct repos *, const char *, size_t *);
+time_t repo_stamp(const struct repo *);
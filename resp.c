@@ -0,0 +1,652 @@
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <inttypes.h>
+#include <poll.h>
+#include <stdint.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "util.h"
+#include "resp.h"
+#include "timing.h"
+
+/* Body bytes gathered before a streamed response writes them out */
+#define RESP_CHUNK 65536
+/* Buffers grown beyond this are given back at the end of a request */
+#define RESP_KEEP (1 << 20)
+/* How long a client taking no data is waited for, in milliseconds */
+#define RESP_TIMEOUT 60000
+
+/*
+ * The response being built. Header fields and body are gathered apart
+ * so the length of the body is known before the headers go out, and
+ * both are handed to the sink in one go at the end of the request.
+ * Bodies compressed for the client pass through z into zout. Responses
+ * framed as HTTP/1.1 get their status line and fields built in line.
+ * Each thread serving requests builds its own.
+ */
+static __thread struct {
+	struct buf head;
+	struct buf body;
+	struct buf line;
+	resp_sink sink;
+	void *arg;
+	int streaming;
+	int nolength;
+	int failed;
+	const char *coding;
+	int compressing;
+	z_stream z;
+	struct buf zout;
+	int http;
+	int minor;
+	int keep;
+	int headonly;
+	int chunked;
+} rs;
+
+/*
+ * Buffers are grown with realloc rather than taken from the arena. The
+ * arena is reset by the request handler, before the response is ended
+ * and written out, and refusals of the HTTP server are built outside
+ * any request. Growing in the arena would also keep each outgrown copy
+ * until the reset. Kept up to RESP_KEEP, they need no allocation from
+ * one request to the next.
+ */
+static void
+buf_grow(struct buf *b, size_t n)
+{
+	size_t cap;
+	char *p;
+
+	if (b->cap - b->len >= n)
+		return;
+	for (cap = b->cap ? b->cap : BUFSIZ; cap - b->len < n; cap *= 2)
+		;
+	if (!(p = realloc(b->s, cap)))
+		eprintf("realloc:");
+	b->s = p;
+	b->cap = cap;
+}
+
+static void
+buf_put(struct buf *b, const void *p, size_t n)
+{
+	buf_grow(b, n);
+	memcpy(b->s + b->len, p, n);
+	b->len += n;
+}
+
+static void
+buf_vprintf(struct buf *b, const char *fmt, va_list ap)
+{
+	va_list aq;
+	int n;
+
+	buf_grow(b, 64);
+	va_copy(aq, ap);
+	n = vsnprintf(b->s + b->len, b->cap - b->len, fmt, aq);
+	va_end(aq);
+	if (n < 0)
+		eprintf("vsnprintf:");
+	if ((size_t)n >= b->cap - b->len) {
+		buf_grow(b, n + 1);
+		vsnprintf(b->s + b->len, n + 1, fmt, ap);
+	}
+	b->len += n;
+}
+
+static void
+buf_printf(struct buf *b, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	buf_vprintf(b, fmt, ap);
+	va_end(ap);
+}
+
+static void
+buf_trim(struct buf *b)
+{
+	b->len = 0;
+	if (b->cap > RESP_KEEP) {
+		free(b->s);
+		b->s = NULL;
+		b->cap = 0;
+	}
+}
+
+static void
+emit(struct iovec *iov, int n)
+{
+	int i;
+
+	if (rs.failed)
+		return;
+	timing_start(TIMER_WRITE);
+	if (rs.sink(rs.arg, iov, n) < 0)
+		rs.failed = 1;
+	timing_stop(TIMER_WRITE);
+	for (i = 0; i < n; i++)
+		timing_count(COUNT_WRITTEN, iov[i].iov_len);
+}
+
+/*
+ * Sends a piece of the body, of at most two iovecs, left out for HEAD
+ * requests and framed as a chunk when the length was not given.
+ */
+static void
+emit_body(struct iovec *iov, int n)
+{
+	struct iovec v[RESP_IOV_MAX];
+	char size[24];
+	size_t len = 0;
+	int i;
+
+	if (rs.headonly)
+		return;
+	if (!rs.chunked) {
+		emit(iov, n);
+		return;
+	}
+
+	for (i = 0; i < n; i++)
+		len += iov[i].iov_len;
+	/* An empty chunk would end the body */
+	if (len == 0)
+		return;
+	v[0].iov_base = size;
+	v[0].iov_len = snprintf(size, sizeof(size), "%zx\r\n", len);
+	memcpy(v + 1, iov, n * sizeof(*v));
+	v[n + 1].iov_base = "\r\n";
+	v[n + 1].iov_len = 2;
+	emit(v, n + 2);
+}
+
+/* Value of the header field name of the response, if it has one */
+static const char *
+field(const char *name)
+{
+	const char *p = rs.head.s, *end = p + rs.head.len;
+	size_t n = strlen(name);
+
+	while (p != NULL && p < end) {
+		if ((size_t)(end - p) > n && !strncasecmp(p, name, n) &&
+		    p[n] == ':')
+			return p + n + 1 + strspn(p + n + 1, " ");
+		if ((p = memchr(p, '\n', end - p)) != NULL)
+			p++;
+	}
+	return NULL;
+}
+
+/* Status code of the response, from its Status field */
+static int
+status_code(void)
+{
+	const char *s;
+
+	return (s = field("Status")) != NULL ? atoi(s) : 200;
+}
+
+/*
+ * Text bodies of successful responses of a length worth it, or of an
+ * unknown length, are compressed if the client takes a coding. Ranges
+ * are left alone as their offsets refer to the plain body.
+ */
+static int
+compressible(off_t len)
+{
+	const char *type, *status;
+
+	if (rs.coding == NULL || rs.nolength || (len >= 0 && len < GZIP_MIN))
+		return 0;
+	return (type = field("Content-Type")) != NULL &&
+	    !strncmp(type, "text/", 5) &&
+	    (status = field("Status")) != NULL && !strncmp(status, "200", 3);
+}
+
+/*
+ * The compressed body is a representation of its own, so its validator
+ * gets the coding appended: "tag" becomes "tag-gzip".
+ */
+static void
+tag_etag(void)
+{
+	const char *p, *q;
+	size_t off, n;
+
+	if ((p = field("ETag")) == NULL ||
+	    (q = memchr(p, '\n', rs.head.s + rs.head.len - p)) == NULL ||
+	    q[-1] != '"')
+		return;
+
+	off = q - 1 - rs.head.s;
+	n = strlen(rs.coding) + 1;
+	buf_grow(&rs.head, n);
+	memmove(rs.head.s + off + n, rs.head.s + off, rs.head.len - off);
+	rs.head.s[off] = '-';
+	memcpy(rs.head.s + off + 1, rs.coding, n - 1);
+	rs.head.len += n;
+}
+
+/*
+ * Turns the CGI header fields into an HTTP/1.1 response head: the Status
+ * field becomes the status line and lines end in CRLF. Bodies of unknown
+ * length are sent in chunks to HTTP/1.1 clients, otherwise delimited by
+ * closing the connection.
+ */
+static void
+http_head(off_t len)
+{
+	const char *p, *q, *end = rs.head.s + rs.head.len;
+	char date[64];
+	struct tm tm;
+	time_t t;
+
+	rs.line.len = 0;
+	if ((p = field("Status")) != NULL)
+		buf_printf(&rs.line, "HTTP/1.1 %.*s\r\n",
+		    (int)strcspn(p, "\n"), p);
+	else
+		buf_printf(&rs.line, "HTTP/1.1 200 OK\r\n");
+	t = time(NULL);
+	if (gmtime_r(&t, &tm) != NULL &&
+	    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm))
+		buf_printf(&rs.line, "Date: %s\r\n", date);
+
+	for (p = rs.head.s; p != NULL && p < end; p = q) {
+		if ((q = memchr(p, '\n', end - p)) != NULL)
+			q++;
+		if (strncasecmp(p, "Status:", 7))
+			buf_printf(&rs.line, "%.*s\r\n",
+			    (int)((q ? q - 1 : end) - p), p);
+	}
+
+	if (rs.nolength)
+		;
+	else if (len >= 0)
+		buf_printf(&rs.line, "Content-Length: %jd\r\n", (intmax_t)len);
+	else if (rs.keep && rs.minor > 0) {
+		buf_printf(&rs.line, "Transfer-Encoding: chunked\r\n");
+		rs.chunked = 1;
+	} else
+		rs.keep = 0;
+	if (!rs.keep)
+		buf_printf(&rs.line, "Connection: close\r\n");
+	else if (rs.minor == 0)
+		buf_printf(&rs.line, "Connection: keep-alive\r\n");
+	buf_put(&rs.line, "\r\n", 2);
+}
+
+/* Fills iov with the header fields, returning how many pieces they took */
+static int
+head_iov(struct iovec *iov, char *field, size_t n, off_t len)
+{
+	int i = 0;
+
+	if (rs.http) {
+		http_head(len);
+		iov[0].iov_base = rs.line.s;
+		iov[0].iov_len = rs.line.len;
+		return 1;
+	}
+
+	iov[i].iov_base = rs.head.s;
+	iov[i++].iov_len = rs.head.len;
+	if (len >= 0 && !rs.nolength) {
+		iov[i].iov_base = field;
+		iov[i++].iov_len = snprintf(field, n, "Content-Length: %jd\n",
+		    (intmax_t)len);
+	}
+	iov[i].iov_base = "\n";
+	iov[i++].iov_len = 1;
+	return i;
+}
+
+static void
+zstart(void)
+{
+	/* Window bits past 15 ask for a gzip rather than a zlib wrapper */
+	memset(&rs.z, 0, sizeof(rs.z));
+	if (deflateInit2(&rs.z, GZIP_LEVEL, Z_DEFLATED,
+	    strcmp(rs.coding, "gzip") ? 15 : 15 + 16, 8,
+	    Z_DEFAULT_STRATEGY) != Z_OK)
+		eprintf("deflateInit2: failed\n");
+	rs.compressing = 1;
+	rs.zout.len = 0;
+
+	tag_etag();
+	hprintf("Content-Encoding: %s\n", rs.coding);
+}
+
+/* Compresses n bytes of p onto zout */
+static void
+zput(const void *p, size_t n, int flush)
+{
+	int r;
+
+	rs.z.next_in = (Bytef *)p;
+	rs.z.avail_in = n;
+	do {
+		buf_grow(&rs.zout, n / 2 + BUFSIZ);
+		rs.z.next_out = (Bytef *)rs.zout.s + rs.zout.len;
+		rs.z.avail_out = rs.zout.cap - rs.zout.len;
+		if ((r = deflate(&rs.z, flush)) == Z_STREAM_ERROR)
+			eprintf("deflate: failed\n");
+		rs.zout.len = rs.zout.cap - rs.z.avail_out;
+	} while (rs.z.avail_out == 0 || (flush == Z_FINISH &&
+	    r != Z_STREAM_END));
+}
+
+static void
+zend(void)
+{
+	deflateEnd(&rs.z);
+	rs.compressing = 0;
+	buf_trim(&rs.zout);
+}
+
+/*
+ * Sends a piece of a streamed body. Compressed ones are flushed piece
+ * by piece so the client can render what it has so far.
+ */
+static void
+stream(const void *p, size_t n, int flush)
+{
+	struct iovec iov;
+	size_t k;
+
+	do {
+		k = n;
+		if (rs.compressing) {
+			k = n < RESP_CHUNK ? n : RESP_CHUNK;
+			zput(p, k, k == n ? flush : Z_NO_FLUSH);
+			iov.iov_base = rs.zout.s;
+			iov.iov_len = rs.zout.len;
+			rs.zout.len = 0;
+		} else {
+			iov.iov_base = (void *)p;
+			iov.iov_len = n;
+		}
+		emit_body(&iov, 1);
+		p = (const char *)p + k;
+		n -= k;
+	} while (n > 0);
+}
+
+static void
+flush_body(void)
+{
+	stream(rs.body.s, rs.body.len, Z_SYNC_FLUSH);
+	rs.body.len = 0;
+}
+
+void
+resp_begin(resp_sink sink, void *arg)
+{
+	rs.head.len = 0;
+	rs.body.len = 0;
+	rs.sink = sink;
+	rs.arg = arg;
+	rs.streaming = 0;
+	rs.nolength = 0;
+	rs.failed = 0;
+	rs.coding = NULL;
+	rs.http = 0;
+	rs.chunked = 0;
+}
+
+/*
+ * Frames the response to an HTTP/1.minor request as HTTP/1.1 rather than
+ * CGI, keeping the connection open after it if keep is set and leaving
+ * out the body if headonly is.
+ */
+void
+resp_http(int minor, int keep, int headonly)
+{
+	rs.http = 1;
+	rs.minor = minor;
+	rs.keep = keep;
+	rs.headonly = headonly;
+}
+
+/* Lets the body be compressed with coding, "gzip" or "deflate" */
+void
+resp_compress(const char *coding)
+{
+	rs.coding = coding;
+}
+
+/* Leaves out Content-Length, for responses like 304 that have no body */
+void
+resp_nolength(void)
+{
+	rs.nolength = 1;
+}
+
+/*
+ * Sends the header fields right away, with the length of the body if it
+ * is known beforehand, so large bodies go out while they are produced.
+ */
+void
+resp_stream(off_t len)
+{
+	char field[64];
+	struct iovec iov[3];
+
+	if (compressible(len)) {
+		zstart();
+		len = -1;
+	}
+
+	timing_fields();
+	emit(iov, head_iov(iov, field, sizeof(field), len));
+	rs.streaming = 1;
+
+	if (rs.body.len > 0)
+		flush_body();
+}
+
+/*
+ * Throws away the response so far, for an error page to take its place,
+ * returning 0. Once streaming began that is too late and the response
+ * is only cut off, returning -1 for the connection to be closed.
+ */
+int
+resp_abort(void)
+{
+	if (rs.streaming) {
+		rs.failed = 1;
+		rs.keep = 0;
+		return -1;
+	}
+	rs.head.len = 0;
+	rs.body.len = 0;
+	rs.nolength = 0;
+	return 0;
+}
+
+int
+resp_end(void)
+{
+	char field[64];
+	struct iovec iov[RESP_IOV_MAX];
+	const struct buf *b = &rs.body;
+	int n;
+
+	if (rs.streaming) {
+		stream(rs.body.s, rs.body.len, Z_FINISH);
+		if (rs.chunked && !rs.headonly) {
+			iov[0].iov_base = "0\r\n\r\n";
+			iov[0].iov_len = 5;
+			emit(iov, 1);
+		}
+		goto done;
+	}
+
+	if (compressible(rs.body.len)) {
+		zstart();
+		zput(rs.body.s, rs.body.len, Z_FINISH);
+		b = &rs.zout;
+	}
+	timing_fields();
+	n = head_iov(iov, field, sizeof(field), b->len);
+	if (!rs.headonly) {
+		iov[n].iov_base = b->s;
+		iov[n++].iov_len = b->len;
+	}
+	emit(iov, n);
+
+done:
+	timing_end(status_code());
+	if (rs.compressing)
+		zend();
+	buf_trim(&rs.head);
+	buf_trim(&rs.body);
+	buf_trim(&rs.line);
+
+	/* The connection may have had to be given up to end the body */
+	return rs.failed || (rs.http && !rs.keep) ? -1 : 0;
+}
+
+/* Whether the peer is gone, so the rest of the body would go nowhere */
+int
+resp_failed(void)
+{
+	return rs.failed;
+}
+
+/*
+ * Sink writing to the file descriptor arg points to, waiting for it to
+ * drain if it does not block.
+ */
+int
+resp_fdsink(void *arg, const struct iovec *iov, int n)
+{
+	struct iovec v[RESP_IOV_MAX];
+	struct pollfd pfd;
+	ssize_t r;
+	int fd = *(int *)arg, i = 0;
+
+	memcpy(v, iov, n * sizeof(*v));
+	while (i < n) {
+		if ((r = writev(fd, v + i, n - i)) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				pfd.fd = fd;
+				pfd.events = POLLOUT;
+				if (poll(&pfd, 1, RESP_TIMEOUT) > 0)
+					continue;
+				weprintf("writev: timed out\n");
+				return -1;
+			}
+			weprintf("writev:");
+			return -1;
+		}
+		/* Carry on after what a short write left behind */
+		for (; i < n && (size_t)r >= v[i].iov_len; i++)
+			r -= v[i].iov_len;
+		if (i < n) {
+			v[i].iov_base = (char *)v[i].iov_base + r;
+			v[i].iov_len -= r;
+		}
+	}
+	return 0;
+}
+
+const struct buf *
+resp_head(void)
+{
+	return &rs.head;
+}
+
+const struct buf *
+resp_body(void)
+{
+	return &rs.body;
+}
+
+void
+hprintf(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	buf_vprintf(&rs.head, fmt, ap);
+	va_end(ap);
+}
+
+void
+bput(const void *p, size_t n)
+{
+	struct iovec iov[2];
+
+	/* Large pieces of a streamed body go out from where they are */
+	if (rs.streaming && n >= RESP_CHUNK && rs.compressing) {
+		flush_body();
+		stream(p, n, Z_SYNC_FLUSH);
+		return;
+	}
+	if (rs.streaming && n >= RESP_CHUNK) {
+		iov[0].iov_base = rs.body.s;
+		iov[0].iov_len = rs.body.len;
+		iov[1].iov_base = (void *)p;
+		iov[1].iov_len = n;
+		emit_body(iov, 2);
+		rs.body.len = 0;
+		return;
+	}
+
+	buf_put(&rs.body, p, n);
+	if (rs.streaming && rs.body.len >= RESP_CHUNK)
+		flush_body();
+}
+
+void
+bputs(const char *s)
+{
+	bput(s, strlen(s));
+}
+
+void
+bputc(int c)
+{
+	char ch = c;
+
+	if (rs.body.len < rs.body.cap && !rs.streaming)
+		rs.body.s[rs.body.len++] = ch;
+	else
+		bput(&ch, 1);
+}
+
+/* Appends n in decimal without going through printf */
+void
+bputu(uintmax_t n)
+{
+	char buf[24], *p = buf + sizeof(buf);
+
+	do
+		*--p = '0' + n % 10;
+	while (n /= 10);
+	bput(p, buf + sizeof(buf) - p);
+}
+
+void
+bprintf(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	buf_vprintf(&rs.body, fmt, ap);
+	va_end(ap);
+
+	if (rs.streaming && rs.body.len >= RESP_CHUNK)
+		flush_body();
+}
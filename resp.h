@@ -0,0 +1,31 @@
+struct buf {
+	char *s;
+	size_t len;
+	size_t cap;
+};
+
+/* Most pieces handed to a sink at once */
+#define RESP_IOV_MAX 4
+
+/* Writes out a piece of the response, returning -1 once the peer is gone */
+typedef int (*resp_sink)(void *, const struct iovec *, int);
+
+void resp_begin(resp_sink, void *);
+void resp_compress(const char *);
+void resp_nolength(void);
+void resp_http(int, int, int);
+void resp_stream(off_t);
+int resp_abort(void);
+int resp_end(void);
+int resp_failed(void);
+int resp_fdsink(void *, const struct iovec *, int);
+const struct buf *resp_head(void);
+const struct buf *resp_body(void);
+
+void hprintf(const char *, ...);
+
+void bput(const void *, size_t);
+void bputs(const char *);
+void bputc(int);
+void bputu(uintmax_t);
+void bprintf(const char *, ...);
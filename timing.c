@@ -0,0 +1,164 @@
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <stdint.h>
+#include <time.h>
+
+#include "util.h"
+#include "resp.h"
+#include "timing.h"
+
+static const char *timers[TIMER_MAX] = {
+	"scan", "open", "walk", "diff", "inflate", "write",
+};
+
+static const char *counts[COUNT_MAX] = {
+	"objects", "inflated", "written",
+};
+
+/*
+ * Where the time of the request being served went. Each phase adds up
+ * the time between its starts and stops, so phases run more than once
+ * are summed. Each thread serving requests keeps its own.
+ */
+static __thread struct {
+	int active;
+	const char *path;
+	const char *route;
+	struct timespec begin;
+	struct timespec start[TIMER_MAX];
+	uint64_t ns[TIMER_MAX];
+	unsigned int used;
+	uint64_t count[COUNT_MAX];
+} tm;
+
+static uint64_t
+since(const struct timespec *t)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)(now.tv_sec - t->tv_sec) * 1000000000 +
+	    (now.tv_nsec - t->tv_nsec);
+}
+
+/* Starts timing a request for path */
+void
+timing_begin(const char *path)
+{
+	memset(&tm, 0, sizeof(tm));
+	tm.active = 1;
+	tm.path = path ? path : "";
+	tm.route = "-";
+	clock_gettime(CLOCK_MONOTONIC, &tm.begin);
+}
+
+/* Names the kind of page served, for latencies to be told apart by it */
+void
+timing_route(const char *route)
+{
+	tm.route = route;
+}
+
+void
+timing_start(int t)
+{
+	clock_gettime(CLOCK_MONOTONIC, &tm.start[t]);
+}
+
+void
+timing_stop(int t)
+{
+	tm.ns[t] += since(&tm.start[t]);
+	tm.used |= 1U << t;
+}
+
+void
+timing_count(int c, uint64_t n)
+{
+	tm.count[c] += n;
+}
+
+/*
+ * Adds the counts of the calling thread to count, for a thread doing
+ * part of a request to hand them over to the one serving it.
+ */
+void
+timing_counts(uint64_t *count)
+{
+	int c;
+
+	for (c = 0; c < COUNT_MAX; c++)
+		count[c] += tm.count[c];
+}
+
+/*
+ * Adds a Server-Timing field with the phases run so far and the time
+ * since the request began, in milliseconds, along with the objects
+ * looked up and the bytes inflated. Having no duration of their own,
+ * these are given in the description of a metric lasting no time.
+ */
+void
+timing_fields(void)
+{
+	int t;
+
+	if (!tm.active)
+		return;
+
+	hprintf("Server-Timing: ");
+	for (t = 0; t < TIMER_MAX; t++)
+		if (tm.used & (1U << t))
+			hprintf("%s;dur=%.3f, ", timers[t], tm.ns[t] / 1e6);
+	hprintf("total;dur=%.3f, objects;desc=\"%ju objects\";dur=0, "
+	    "inflated;desc=\"%ju bytes\";dur=0\n",
+	    since(&tm.begin) / 1e6, (uintmax_t)tm.count[COUNT_OBJECTS],
+	    (uintmax_t)tm.count[COUNT_INFLATED]);
+}
+
+/*
+ * Ends timing the request answered with status. With TIMING_LOG set a
+ * line of key=value pairs goes to stderr for it, times in milliseconds.
+ */
+void
+timing_end(int status)
+{
+	char line[1024];
+	const unsigned char *p;
+	size_t n;
+	int t;
+
+	if (!tm.active)
+		return;
+	tm.active = 0;
+	if (!TIMING_LOG)
+		return;
+
+	n = snprintf(line, sizeof(line), "route=%s status=%d total=%.3f",
+	    tm.route, status, since(&tm.begin) / 1e6);
+	for (t = 0; t < TIMER_MAX; t++)
+		n += snprintf(line + n, sizeof(line) - n, " %s=%.3f",
+		    timers[t], tm.ns[t] / 1e6);
+	for (t = 0; t < COUNT_MAX; t++)
+		n += snprintf(line + n, sizeof(line) - n, " %s=%ju",
+		    counts[t], (uintmax_t)tm.count[t]);
+
+	/* Quoted last, cut short if need be */
+	n += snprintf(line + n, sizeof(line) - n, " path=\"");
+	for (p = (const unsigned char *)tm.path;
+	    *p && n + 6 < sizeof(line); p++) {
+		if (*p == '"' || *p == '\\')
+			n += snprintf(line + n, sizeof(line) - n, "\\%c", *p);
+		else if (*p < 0x20 || *p >= 0x7f)
+			n += snprintf(line + n, sizeof(line) - n, "\\x%02x",
+			    *p);
+		else
+			line[n++] = *p;
+	}
+	line[n++] = '"';
+	line[n++] = '\n';
+	line[n] = '\0';
+
+	/* In one go, so lines of threads do not mix */
+	fputs(line, stderr);
+}
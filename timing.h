@@ -0,0 +1,23 @@
+/* Phases of a request, timed on their own */
+#define TIMER_SCAN 0
+#define TIMER_OPEN 1
+#define TIMER_WALK 2
+#define TIMER_DIFF 3
+#define TIMER_INFLATE 4
+#define TIMER_WRITE 5
+#define TIMER_MAX 6
+
+/* Quantities counted over a request */
+#define COUNT_OBJECTS 0
+#define COUNT_INFLATED 1
+#define COUNT_WRITTEN 2
+#define COUNT_MAX 3
+
+void timing_begin(const char *);
+void timing_route(const char *);
+void timing_start(int);
+void timing_stop(int);
+void timing_count(int, uint64_t);
+void timing_counts(uint64_t *);
+void timing_fields(void);
+void timing_end(int);
@@ -1,4 +1,51 @@
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_SIMD
+#endif
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <pthread.h>
+
+#include "compat.h"
 #include "util.h"
+#include "resp.h"
+
+#define CS_NUL 1
+#define CS_CTL 2
+
+/*
+ * Bytes the escaping functions do not copy through: those in list, NUL
+ * with CS_NUL and everything below 0x20 or from 0x7f on with CS_CTL.
+ * The table is filled in once on first use for the portable scanner.
+ */
+struct charset {
+	const char *list;
+	int flags;
+	unsigned char table[256];
+};
+
+static struct charset htmlset = { "&<>\"'", CS_NUL, { 0 } };
+static struct charset uriset = { " \"%<>\\^`{|}", CS_CTL, { 0 } };
+static struct charset queryset = { " \"%<>\\^`{|}#&'+;=?", CS_CTL, { 0 } };
+
+static size_t (*scanfn)(const struct charset *, const unsigned char *,
+    size_t);
+static pthread_once_t scan_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Errors met while a request is served unwind to it through errjmp
+ * instead of ending the process. What the request holds meanwhile is
+ * kept in holds, to be freed on the way.
+ */
+static __thread jmp_buf *errjmp;
+static __thread struct hold {
+	void *p;
+	void (*fn)(void *);
+} *holds;
+static __thread size_t nholds;
+static __thread size_t holdcap;
 
 const void
 veprintf(const char *fmt, va_list ap)
@@ -19,6 +66,8 @@ eprintf(const char *fmt, ...)
 	veprintf(fmt, ap);
 	va_end(ap);
 
+	if (errjmp != NULL)
+		longjmp(*errjmp, 1);
 	exit(1);
 }
 
@@ -42,8 +91,8 @@ gvprintf(const char *fmt, va_list ap)
 	if ((err = giterr_last()) != NULL && err->message != NULL) {
 		fputc(' ', stderr);
 		fputs(err->message, stderr);
-	} else
-		fputc('\n', stderr);
+	}
+	fputc('\n', stderr);
 }
 
 void
@@ -55,6 +104,8 @@ geprintf(const char *fmt, ...)
 	gvprintf(fmt, ap);
 	va_end(ap);
 
+	if (errjmp != NULL)
+		longjmp(*errjmp, 1);
 	exit(1);
 }
 
@@ -68,46 +119,276 @@ gweprintf(const char *fmt, ...)
 	va_end(ap);
 }
 
+/*
+ * Has errors unwind to jb rather than exit, or exit again if it is NULL,
+ * returning where they unwound to before.
+ */
+jmp_buf *
+catch_errors(jmp_buf *jb)
+{
+	jmp_buf *prev = errjmp;
+
+	errjmp = jb;
+	return prev;
+}
+
+void
+hold(void *p, void (*fn)(void *))
+{
+	struct hold *h;
+	size_t cap;
+
+	if (p == NULL)
+		return;
+	if (nholds == holdcap) {
+		cap = holdcap ? holdcap * 2 : 64;
+		if (!(h = reallocarray(holds, cap, sizeof(*h)))) {
+			fn(p);
+			eprintf("reallocarray:");
+		}
+		holds = h;
+		holdcap = cap;
+	}
+	holds[nholds].p = p;
+	holds[nholds++].fn = fn;
+}
+
+/* Stops holding p, returning how it was to be freed or NULL */
+static void (*drop(void *p))(void *)
+{
+	void (*fn)(void *);
+	size_t i;
+
+	if (p == NULL)
+		return NULL;
+	/* What was held last is mostly let go first */
+	for (i = nholds; i-- > 0; )
+		if (holds[i].p == p)
+			break;
+	if (i == (size_t)-1)
+		return NULL;
+	fn = holds[i].fn;
+	memmove(holds + i, holds + i + 1, (nholds - i - 1) * sizeof(*holds));
+	nholds--;
+	return fn;
+}
+
+/* Frees p, which was held, the way hold() was told to */
+void
+release(void *p)
+{
+	void (*fn)(void *);
+
+	if ((fn = drop(p)) != NULL)
+		fn(p);
+}
+
+/* Stops holding p without freeing it, once it is handed on */
+void
+unhold(void *p)
+{
+	drop(p);
+}
+
+/* Frees everything still held, newest first, after an error */
+void
+release_all(void)
+{
+	while (nholds > 0) {
+		nholds--;
+		holds[nholds].fn(holds[nholds].p);
+	}
+}
+
 void
 htmlescchar(const char c)
 {
 	switch(c) {
 	case '&':
-		fputs("&amp;", stdout);
+		bputs("&amp;");
 		break;
 	case '<':
-		fputs("&lt;", stdout);
+		bputs("&lt;");
 		break;
 	case '>':
-		fputs("&gt;", stdout);
+		bputs("&gt;");
 		break;
 	case '\"':
-		fputs("&#34;", stdout);
+		bputs("&#34;");
 		break;
 	case '\'':
-		fputs("&#39;", stdout);
+		bputs("&#39;");
 		break;
 	default:
-		putchar(c);
+		bputc(c);
+	}
+}
+
+static size_t
+scan_c(const struct charset *cs, const unsigned char *s, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n && !cs->table[s[i]]; i++)
+		;
+	return i;
+}
+
+#ifdef HAVE_SIMD
+static size_t
+scan_sse2(const struct charset *cs, const unsigned char *s, size_t n)
+{
+	__m128i v, m;
+	const char *c;
+	size_t i;
+	int bits;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(s + i));
+		m = _mm_setzero_si128();
+		/* Signed, so bytes from 0x80 on are below 0x20 as well */
+		if (cs->flags & CS_CTL)
+			m = _mm_or_si128(_mm_cmplt_epi8(v, _mm_set1_epi8(0x20)),
+			    _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7f)));
+		if (cs->flags & CS_NUL)
+			m = _mm_or_si128(m, _mm_cmpeq_epi8(v,
+			    _mm_setzero_si128()));
+		for (c = cs->list; *c; c++)
+			m = _mm_or_si128(m, _mm_cmpeq_epi8(v,
+			    _mm_set1_epi8(*c)));
+		if ((bits = _mm_movemask_epi8(m)) != 0)
+			return i + __builtin_ctz(bits);
+	}
+	return i + scan_c(cs, s + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t
+scan_avx2(const struct charset *cs, const unsigned char *s, size_t n)
+{
+	__m256i v, m;
+	const char *c;
+	size_t i;
+	unsigned int bits;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(s + i));
+		m = _mm256_setzero_si256();
+		if (cs->flags & CS_CTL)
+			m = _mm256_or_si256(_mm256_cmpgt_epi8(
+			    _mm256_set1_epi8(0x20), v), _mm256_cmpeq_epi8(v,
+			    _mm256_set1_epi8(0x7f)));
+		if (cs->flags & CS_NUL)
+			m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v,
+			    _mm256_setzero_si256()));
+		for (c = cs->list; *c; c++)
+			m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v,
+			    _mm256_set1_epi8(*c)));
+		if ((bits = _mm256_movemask_epi8(m)) != 0)
+			return i + __builtin_ctz(bits);
+	}
+	return i + scan_sse2(cs, s + i, n - i);
+}
+#endif
+
+static void
+charset_init(struct charset *cs)
+{
+	const char *c;
+	int i;
+
+	for (c = cs->list; *c; c++)
+		cs->table[(unsigned char)*c] = 1;
+	if (cs->flags & CS_NUL)
+		cs->table[0] = 1;
+	if (cs->flags & CS_CTL)
+		for (i = 0; i < 256; i++)
+			if (i < 0x20 || i >= 0x7f)
+				cs->table[i] = 1;
+}
+
+static void
+scan_init(void)
+{
+	charset_init(&htmlset);
+	charset_init(&uriset);
+	charset_init(&queryset);
+	scanfn = scan_c;
+#ifdef HAVE_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		scanfn = scan_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		scanfn = scan_sse2;
+#endif
+}
+
+/* Length of the leading run of s that needs no escaping */
+static size_t
+scan(const struct charset *cs, const char *s, size_t n)
+{
+	pthread_once(&scan_once, scan_init);
+	return scanfn(cs, (const unsigned char *)s, n);
+}
+
+/* Escapes n bytes of s, writing the runs in between in one go */
+void
+htmlescn(const char *s, size_t n)
+{
+	const char *end;
+	size_t k;
+
+	for (end = s + n; s < end; s += k + 1) {
+		if ((k = scan(&htmlset, s, end - s)) > 0)
+			bput(s, k);
+		if (s + k == end)
+			break;
+		if (s[k] == '\0')
+			bputs("&#65533;");
+		else
+			htmlescchar(s[k]);
 	}
 }
 
 void
 htmlesc(const char *s)
 {
-	for (; s && *s; s++)
-		htmlescchar(*s);
+	if (s != NULL)
+		htmlescn(s, strlen(s));
+}
+
+static void
+percentenc(const struct charset *cs, const char *s)
+{
+	char hex[3] = "%";
+	const char *end;
+	size_t k;
+
+	if (s == NULL)
+		return;
+
+	for (end = s + strlen(s); s < end; s += k + 1) {
+		if ((k = scan(cs, s, end - s)) > 0)
+			bput(s, k);
+		if (s + k == end)
+			break;
+		hex[1] = "0123456789ABCDEF"[(unsigned char)s[k] >> 4];
+		hex[2] = "0123456789ABCDEF"[(unsigned char)s[k] & 0xf];
+		bput(hex, 3);
+	}
 }
 
 void
 urienc(const char *s)
 {
-	for (; s && *s; s++)
-		if ((unsigned char)*s <= 0x1F || (unsigned char)*s >= 0x7F ||
-		    strchr(" <>\"%{}|\\^`", *s))
-			printf("%%%02X", (unsigned char)*s);
-		else
-			putchar(*s);
+	percentenc(&uriset, s);
+}
+
+/* Like urienc() but also for the characters delimiting query values */
+void
+queryenc(const char *s)
+{
+	percentenc(&queryset, s);
 }
 
 void
@@ -121,20 +402,41 @@ abbrev(char *s, size_t n)
 	}
 }
 
+static char *
+put2(char *p, int n)
+{
+	*p++ = '0' + n / 10 % 10;
+	*p++ = '0' + n % 10;
+	return p;
+}
+
+/* Writes gt as YYYY-MM-DD&nbsp;HH:MM, filling in the digits by hand */
 void
 printgt(const git_time_t gt)
 {
+	char buf[32], *p;
 	struct tm m;
 
 	if (gmtime_r(&gt, &m) == NULL)
 		return;
+	if (m.tm_year + 1900 < 0 || m.tm_year + 1900 > 9999) {
+		bprintf("%.4u-%02u-%02u&nbsp;%02u:%02u",
+		    m.tm_year + 1900, m.tm_mon + 1, m.tm_mday, m.tm_hour,
+		    m.tm_min);
+		return;
+	}
 
-	printf("%.4u-%02u-%02u&nbsp;%02u:%02u",
-	    m.tm_year + 1900,
-	    m.tm_mon + 1,
-	    m.tm_mday,
-	    m.tm_hour,
-	    m.tm_min);
+	p = put2(buf, (m.tm_year + 1900) / 100);
+	p = put2(p, m.tm_year + 1900);
+	*p++ = '-';
+	p = put2(p, m.tm_mon + 1);
+	*p++ = '-';
+	p = put2(p, m.tm_mday);
+	memcpy(p, "&nbsp;", 6);
+	p = put2(p + 6, m.tm_hour);
+	*p++ = ':';
+	p = put2(p, m.tm_min);
+	bput(buf, p - buf);
 }
 
 void
@@ -153,5 +455,5 @@ printgo(int o)
 	h = o / 60;
 	m = o % 60;
 
-	printf("%c%02d%02d", sign, h, m);
+	bprintf("%c%02d%02d", sign, h, m);
 }
@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,9 +12,20 @@ void weprintf(const char *, ...);
 void geprintf(const char *, ...);
 void gweprintf(const char *, ...);
 
+/* Has p freed by fn should an error unwind the request holding it */
+#define HOLD(p, fn) hold((p), (void (*)(void *))(void (*)(void))(fn))
+
+jmp_buf *catch_errors(jmp_buf *);
+void hold(void *, void (*)(void *));
+void release(void *);
+void unhold(void *);
+void release_all(void);
+
 void htmlescchar(const char);
 void htmlesc(const char *);
+void htmlescn(const char *, size_t);
 void urienc(const char *);
+void queryenc(const char *);
 
 void abbrev(char *, size_t);
 void printgt(const git_time_t);